@@ -7,55 +7,31 @@
 
 #include <algorithm>
 #include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
-#include <tuple>
+#include <thread>
 #include <vector>
 
-using namespace std;
+#include <fcntl.h>
+#include <unistd.h>
 
-static const unsigned char basemap[256] = {
-    0,   1,   2,   3,   4,   5,   6,   7,   8,   9,   10,  11,  12,  13,  14,
-    15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,  28,  29,
-    30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,  41,  42,  43,  44,
-    45,  46,  47,  48,  49,  50,  51,  52,  53,  54,  55,  56,  57,  58,  59,
-    60,  61,  62,  63,  64,  'T', 'V', 'G', 'H', 'E', 'F', 'C', 'D', 'I', 'J',
-    'M', 'L', 'K', 'N', 'O', 'P', 'Q', 'Y', 'S', 'A', 'A', 'B', 'W', 'X', 'R',
-    'Z', 91,  92,  93,  94,  95,  96,  't', 'v', 'g', 'h', 'e', 'f', 'c', 'd',
-    'i', 'j', 'm', 'l', 'k', 'n', 'o', 'p', 'q', 'y', 's', 'a', 'a', 'b', 'w',
-    'x', 'r', 'z', 123, 124, 125, 126, 127, 128, 129, 130, 131, 132, 133, 134,
-    135, 136, 137, 138, 139, 140, 141, 142, 143, 144, 145, 146, 147, 148, 149,
-    150, 151, 152, 153, 154, 155, 156, 157, 158, 159, 160, 161, 162, 163, 164,
-    165, 166, 167, 168, 169, 170, 171, 172, 173, 174, 175, 176, 177, 178, 179,
-    180, 181, 182, 183, 184, 185, 186, 187, 188, 189, 190, 191, 192, 193, 194,
-    195, 196, 197, 198, 199, 200, 201, 202, 203, 204, 205, 206, 207, 208, 209,
-    210, 211, 212, 213, 214, 215, 216, 217, 218, 219, 220, 221, 222, 223, 224,
-    225, 226, 227, 228, 229, 230, 231, 232, 233, 234, 235, 236, 237, 238, 239,
-    240, 241, 242, 243, 244, 245, 246, 247, 248, 249, 250, 251, 252, 253, 254,
-    255};
-
-// Switch the counts for complement bases
-map<string, int> switch_complement_counts(map<string, int> m) {
-  map<string, int> m2{
-      {"coverage", m["coverage"]},
-      {"ref", m["ref"]},
-      {"mut", m["mut"]},
-      {"a", m["t"]},
-      {"c", m["g"]},
-      {"g", m["c"]},
-      {"t", m["a"]},
-      {"n", m["n"]},
-      {"skip", m["skip"]},
-      {"gap", m["gap"]},
-      {"insert", m["insert"]},
-      {"delete", m["delete"]},
-  };
-  return m2;
-}
+#include "libcpup.hpp"
+#include "site_store.hpp"
+
+using namespace std;
+using namespace cpup;
 
 void usage() {
   std::cerr
@@ -73,641 +49,486 @@ void usage() {
       << "  -e, --ends          append read ends (5' | 3') count" << endl
       << "  -c, --count []      select count columns" << endl
       << "  -f, --filter []     filter sites" << endl
-      << "  -F, --drop []       drop sites" << endl;
+      << "  -F, --drop []       drop sites" << endl
+      << "  -q, --mapq          append MAPQ histogram" << endl
+      << "  -p, --read-pos      append read position histogram" << endl
+      << "  --input-MAPQ        input has MAPQ columns (mpileup --output-MAPQ)"
+      << endl
+      << "  --input-BP          input has BP columns (mpileup --output-BP)"
+      << endl
+      << "  --trim-bp []        drop bases in the first [] bp of reads (and depth)"
+      << endl
+      << "  --mask-exclude []   drop sites in BED/VCF file" << endl
+      << "  --mask-include []   keep only sites in BED/VCF file" << endl
+      << "  -x, --index []      write position index of output" << endl
+      << "  -o, --output []     write output to file" << endl
+      << "  --checkpoint []     record progress to file, resume from it" << endl
+      << "  --score []          append p-value, binom[:rate] or fisher[:control]"
+      << endl
+      << "  --rle               collapse runs of ref-only sites to chr start end"
+         " depths"
+      << endl
+      << "  --max-depth []      drop sites deeper than [] (or pNN with --two-pass)"
+      << endl
+      << "  --two-pass          spill sites to a store, filter with genome-wide"
+         " stats"
+      << endl
+      << "  --store []          keep the store of --two-pass in file" << endl
+      << endl
+      << "  cpup query [-H] [-x <.cpi>] <out.tsv> <chr:start-end> ..." << endl
+      << "  cpup run --ref <.fa> [--bed <.bed>] [-j N] [options] <.bam> ..."
+      << endl
+      << endl
+      << "  --ref []            reference fasta (indexed by samtools faidx)"
+      << endl
+      << "  --bed []            pile up sites in bed file only" << endl
+      << "  -j, --jobs []       number of samtools workers" << endl
+      << "  --samtools []       path of samtools" << endl
+      << "  --mpileup-args []   samtools mpileup arguments"
+         " (default: \"-d 0 -Q 10 --reverse-del\")"
+      << endl
+      << endl
+      << "  samtools mpileup ... <new.bam> ... | cpup merge --fai <.fai>"
+         " [options] <old.tsv|old.cps>"
+      << endl
+      << endl
+      << "  --fai []            contig order (samtools faidx index)" << endl
+      << "  --store []          also write merged sites to store" << endl;
 }
 
-// global variables
-vector<string> names = {"a",    "c",   "g",      "t",     "n",
-                        "skip", "gap", "insert", "delete"};
-vector<string> names_upper = {"A",    "C",   "G",      "T",     "N",
-                              "Skip", "Gap", "Insert", "Delete"};
-
-string count_sep = ",";
-string indel_sep = "|";
-string sample_sep = "\t";
-
-// Convert a number to a string
-inline int str_to_num(string num) {
-  stringstream ss;
-  int num_uint;
-  ss << num;
-  ss >> num_uint;
-  return num_uint;
-}
+// Error of writing output files, which stops the run
+struct io_error : runtime_error {
+  using runtime_error::runtime_error;
+};
 
-// DS to hold the pertinent information
-class mpileup_line {
+// Output buffer that counts the bytes written through it
+class counting_buf : public streambuf {
 public:
-  int pos, nsample;
-  string chr, ref_base;
-  // Counts for different bases
-  vector<map<string, int>> Counts, counts, Istats, istats, Dstats, dstats;
-  vector<int> sstats, estats;
-  vector<int> depths;
-  vector<string> count_names;
-  //= vector<string>{};
-
-  mpileup_line() {
-    chr = ref_base = "NA";
-    pos = 0;
-  }
-
-  void print_header(int nsample, ostream &out = cout, bool stat_indel = false,
-                    bool stat_ends = false, bool hide_strand = false,
-                    bool by_strand = false) {
-    out << "chr" << sample_sep << "pos" << sample_sep << "ref_base";
-    if (by_strand) {
-      out << sample_sep << "strand";
-    }
-    for (int i = 0; i < nsample; i++) {
-      if (count_names.size() == 0) {
-        out << sample_sep << "depth";
-      } else {
-        out << sample_sep;
-      }
-      if (!hide_strand && !by_strand) {
-        // output header of upper case
-        if (count_names.size() > 0) {
-          for (int j = 0; j < count_names.size(); j++) {
-            string col = count_names[j];
-            std::transform(col.begin(), col.begin() + 1, col.begin(),
-                           [](unsigned char c) { return ::toupper(c); });
-            if (j == 0) {
-              out << col;
-            } else {
-              out << count_sep << col;
-            }
-          }
-        } else {
-          for (int j = 0; j < names_upper.size(); j++) {
-            out << count_sep << names_upper[j];
-          }
-        }
-        if (stat_indel) {
-          out << count_sep << "Istat";
-          out << count_sep << "Dstat";
-        }
-        out << count_sep;
-      }
-      // output header of lower case
-      if (count_names.size() > 0) {
-        for (int j = 0; j < count_names.size(); j++) {
-          if (j == 0) {
-            out << count_names[j];
-          } else {
-            out << count_sep << count_names[j];
-          }
-        }
-      } else {
-        for (int j = 0; j < names.size(); j++) {
-          out << count_sep << names[j];
-        }
-      }
-      if (stat_indel) {
-        out << count_sep << "istat";
-        out << count_sep << "dstat";
-      }
-      if (stat_ends) {
-        out << count_sep << "sstat";
-        out << count_sep << "estat";
-      }
-      // if (i < nsample - 1) {
-      //   out << sample_sep;
-      // }
-    }
-    out << endl;
-  }
-
-  void print_counter(ostream &out = cout, bool stat_indel = false,
-                     bool stat_ends = false, bool hide_strand = false,
-                     bool by_strand = false, char strands = '*') {
-    // forward strand
-    if (by_strand) {
-      if (strands == '*' || strands == '+') {
-        out << chr << sample_sep << pos << sample_sep << ref_base << sample_sep
-            << "+";
-        for (int i = 0; i < nsample; i++) {
-          map<string, int> M = Counts[i];
-          // out << sample_sep << depths[i];
-          // show depth
-          if (count_names.size() == 0) {
-            out << sample_sep << M["coverage"];
-          } else {
-            out << sample_sep;
-          }
+  // write to fd, or to stdout when fd is negative, counting from offset
+  explicit counting_buf(int fd, uint64_t offset = 0)
+      : target(fd < 0 ? cout.rdbuf() : nullptr), fd(fd), flushed(offset) {
+    setp(buf, buf + sizeof(buf));
+  }
+  ~counting_buf() { sync(); }
 
-          if (count_names.size() > 0) {
-            for (int j = 0; j < count_names.size(); j++) {
-              if (j == 0) {
-                out << M[count_names[j]];
-              } else {
-                out << count_sep << M[count_names[j]];
-              };
-            }
-          } else {
-            for (int j = 0; j < names.size(); j++) {
-              out << count_sep << M[names[j]];
-            }
-          }
-          // indel stat
-          if (stat_indel) {
-            vector<map<string, int>> indel_stats = {Istats[i], Dstats[i]};
-            for (auto ids : indel_stats) {
-              out << count_sep;
-              for (auto iter = ids.begin(); iter != ids.end(); ++iter) {
-                if (std::next(iter) != ids.end()) {
-                  out << iter->first << ':' << iter->second << indel_sep;
-                } else {
-                  out << iter->first << ':' << iter->second;
-                }
-              }
-            }
-          }
-        }
-        out << endl;
-      }
-      // reverse strand
-      if (strands == '*' || strands == '-') {
-        out << chr << sample_sep << pos << sample_sep << basemap[ref_base[0]]
-            << sample_sep << "-";
-        for (int i = 0; i < nsample; i++) {
-          map<string, int> m = switch_complement_counts(counts[i]);
-          // out << sample_sep << depths[i];
-          // show depth
-          if (count_names.size() == 0) {
-            out << sample_sep << m["coverage"];
-          } else {
-            out << sample_sep;
-          }
-          if (count_names.size() > 0) {
-            for (int j = 0; j < count_names.size(); j++) {
-              if (j == 0) {
-                out << m[count_names[j]];
-              } else {
-                out << count_sep << m[count_names[j]];
-              };
-            }
-          } else {
-            for (int j = 0; j < names.size(); j++) {
-              out << count_sep << m[names[j]];
-            }
-          }
-          // indel stat
-          if (stat_indel) {
-            vector<map<string, int>> indel_stats = {istats[i], dstats[i]};
-            for (auto ids : indel_stats) {
-              out << count_sep;
-              for (auto iter = ids.begin(); iter != ids.end(); ++iter) {
-                if (std::next(iter) != ids.end()) {
-                  out << iter->first << ':' << iter->second << indel_sep;
-                } else {
-                  out << iter->first << ':' << iter->second;
-                }
-              }
-            }
-          }
-        }
-        out << endl;
-      }
-    } // end by_strand
-
-    else if (hide_strand) {
-      out << chr << sample_sep << pos << sample_sep << ref_base;
-      for (int i = 0; i < nsample; i++) {
-        map<string, int> M = Counts[i];
-        map<string, int> m = counts[i];
-        // show depth
-        if (count_names.size() == 0) {
-          out << sample_sep << depths[i];
-        } else {
-          out << sample_sep;
-        }
-        if (count_names.size() > 0) {
-          for (int j = 0; j < count_names.size(); j++) {
-            if (j == 0) {
-              out << M[count_names[j]] + m[count_names[j]];
-            } else {
-              out << count_sep << M[count_names[j]] + m[count_names[j]];
-            };
-          }
-        } else {
-          for (int j = 0; j < names.size(); j++) {
-            out << count_sep << M[names[j]] + m[names[j]];
-          }
-        }
-        // indel stat
-        if (stat_indel) {
-          // insersion
-          vector<map<string, int>> insertion_stats = {
-              Istats[i],
-              istats[i],
-          };
-          map<string, int> insertion_no_strand;
-          for (auto ids : insertion_stats) {
-            for (auto iter = ids.begin(); iter != ids.end(); ++iter) {
-              string motif = iter->first;
-              std::transform(motif.begin(), motif.end(), motif.begin(),
-                             [](unsigned char c) { return ::toupper(c); });
-              insertion_no_strand[motif] += iter->second;
-            }
-          }
-          out << count_sep;
-          for (auto iter = insertion_no_strand.begin();
-               iter != insertion_no_strand.end(); ++iter) {
-            if (std::next(iter) != insertion_no_strand.end()) {
-              out << iter->first << ':' << iter->second << indel_sep;
-            } else {
-              out << iter->first << ':' << iter->second;
-            }
-          }
-          // deletion
-          vector<map<string, int>> deletion_stats = {
-              Dstats[i],
-              dstats[i],
-          };
-          map<string, int> deletion_no_strand;
-          for (auto ids : deletion_stats) {
-            for (auto iter = ids.begin(); iter != ids.end(); ++iter) {
-              string motif = iter->first;
-              std::transform(motif.begin(), motif.end(), motif.begin(),
-                             [](unsigned char c) { return ::toupper(c); });
-              deletion_no_strand[motif] += iter->second;
-            }
-          }
-          out << count_sep;
-          for (auto iter = deletion_no_strand.begin();
-               iter != deletion_no_strand.end(); ++iter) {
-            if (std::next(iter) != deletion_no_strand.end()) {
-              out << iter->first << ':' << iter->second << indel_sep;
-            } else {
-              out << iter->first << ':' << iter->second;
-            }
-          }
-        }
-        // ends stat
-        if (stat_ends) {
-          out << count_sep << sstats[i];
-          out << count_sep << estats[i];
-        }
-      }
-      out << endl;
-    } // end hide_strand
+  // bytes written so far, including the buffered ones
+  uint64_t bytes() const { return flushed + (pptr() - pbase()); }
 
-    else {
-      out << chr << sample_sep << pos << sample_sep << ref_base;
-      for (int i = 0; i < nsample; i++) {
+protected:
+  int overflow(int c) override {
+    if (flush_buf() < 0) {
+      return EOF;
+    }
+    if (c != EOF) {
+      *pptr() = c;
+      pbump(1);
+    }
+    return c;
+  }
 
-        // show depth
-        if (count_names.size() == 0) {
-          out << sample_sep << depths[i];
-        } else {
-          out << sample_sep;
-        }
+  int sync() override {
+    if (flush_buf() < 0) {
+      return -1;
+    }
+    return target ? target->pubsync() : 0;
+  }
 
-        // show forward strand
-        map<string, int> M = Counts[i];
-        if (count_names.size() > 0) {
-          for (int j = 0; j < count_names.size(); j++) {
-            if (j == 0) {
-              out << M[count_names[j]];
-            } else {
-              out << count_sep << M[count_names[j]];
-            };
-          }
-        } else {
-          for (int j = 0; j < names.size(); j++) {
-            out << count_sep << M[names[j]];
-          }
-        }
-        // indel stat
-        if (stat_indel) {
-          vector<map<string, int>> indel_stats = {Istats[i], Dstats[i]};
-          for (auto ids : indel_stats) {
-            out << count_sep;
-            for (auto iter = ids.begin(); iter != ids.end(); ++iter) {
-              if (std::next(iter) != ids.end()) {
-                out << iter->first << ':' << iter->second << indel_sep;
-              } else {
-                out << iter->first << ':' << iter->second;
-              }
-            }
-          }
-        }
+private:
+  streambuf *target;
+  int fd;
+  uint64_t flushed;
+  char buf[1 << 16];
 
-        // show reverse strand
-        map<string, int> m = counts[i];
-        if (count_names.size() > 0) {
-          for (int j = 0; j < count_names.size(); j++) {
-            out << count_sep << m[count_names[j]];
-          }
-        } else {
-          for (int j = 0; j < names.size(); j++) {
-            out << count_sep << m[names[j]];
-          }
-        }
-        // indel stat
-        if (stat_indel) {
-          vector<map<string, int>> indel_stats = {istats[i], dstats[i]};
-          for (auto ids : indel_stats) {
-            out << count_sep;
-            for (auto iter = ids.begin(); iter != ids.end(); ++iter) {
-              if (std::next(iter) != ids.end()) {
-                out << iter->first << ':' << iter->second << indel_sep;
-              } else {
-                out << iter->first << ':' << iter->second;
-              }
-            }
-          }
-        }
+  int flush_buf() {
+    streamsize n = pptr() - pbase();
+    if (target && n > 0 && target->sputn(pbase(), n) != n) {
+      return -1;
+    }
+    for (streamsize k = 0; !target && k < n;) {
+      ssize_t w = write(fd, pbase() + k, n - k);
+      if (w < 0) {
+        return -1;
       }
-      out << endl;
-    } // end
+      k += w;
+    }
+    flushed += n;
+    setp(buf, buf + sizeof(buf));
+    return 0;
   }
 };
 
-// Parse the pileup string
-tuple<map<string, int>, map<string, int>, map<string, int>, map<string, int>,
-      map<string, int>, map<string, int>, int, int>
-parse_counts(string &bases, string &qual) {
-  // forward strand
-  map<string, int> M{
-      {"coverage", 0}, {"ref", 0}, {"mut", 0},    {"a", 0},
-      {"c", 0},        {"g", 0},   {"t", 0},      {"n", 0},
-      {"skip", 0},     {"gap", 0}, {"insert", 0}, {"delete", 0},
-  };
-  // reverse strand
-  map<string, int> m{
-      {"coverage", 0}, {"ref", 0}, {"mut", 0},    {"a", 0},
-      {"c", 0},        {"g", 0},   {"t", 0},      {"n", 0},
-      {"skip", 0},     {"gap", 0}, {"insert", 0}, {"delete", 0},
+// Open the -o file, or return -1 for stdout
+int open_output(const string &path, bool truncate = true) {
+  if (path.empty()) {
+    return -1;
+  }
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0),
+                0644);
+  if (fd < 0) {
+    throw runtime_error("Can not open output file: " + path);
+  }
+  return fd;
+}
+
+// Read stdin in blocks of buf until the end of the first line, return all
+// that was read
+string read_first_line(vector<char> &buf) {
+  string first;
+  size_t n;
+  while (first.find('\n') == string::npos &&
+         (n = fread(buf.data(), 1, buf.size(), stdin)) > 0) {
+    first.append(buf.data(), n);
+  }
+  return first;
+}
+
+// Linear index of output byte offsets for fixed position bins, per contig
+class position_index {
+public:
+  static const uint32_t magic = 0x01495043; // "CPI\1"
+  int bin_shift = 14;
+
+  struct contig {
+    string name;
+    // offset of the first record at or after the start of each bin
+    vector<uint64_t> offsets;
   };
-  map<string, int> istat;
-  map<string, int> dstat;
-  map<string, int> Istat;
-  map<string, int> Dstat;
-  int sstat = 0;
-  int estat = 0;
-
-  // check if site is a empty (depth == 0)
-  if (bases == "*") {
-    return make_tuple(M, m, Istat, istat, Dstat, dstat, sstat, estat);
-  }
-  for (int i = 0; i < bases.length(); i++) {
-    char base = bases[i];
-    string indelsize_string;
-    string indelseq;
-    int indelsize_int = 0;
-    switch (base) {
-    // Match to reference
-    case '.':
-      M["ref"] += 1;
-      break;
-    case ',':
-      m["ref"] += 1;
-      break;
-    case 'A':
-      M["a"] += 1;
-      break;
-    case 'a':
-      m["a"] += 1;
-      break;
-    case 'C':
-      M["c"] += 1;
-      break;
-    case 'c':
-      m["c"] += 1;
-      break;
-    case 'G':
-      M["g"] += 1;
-      break;
-    case 'g':
-      m["g"] += 1;
-      break;
-    case 'T':
-      M["t"] += 1;
-      break;
-    case 't':
-      m["t"] += 1;
-      break;
-    case 'N':
-      M["n"] += 1;
-      break;
-    case 'n':
-      m["n"] += 1;
-      break;
-    // Reference skips
-    case '>':
-      M["skip"] += 1;
-      break;
-    case '<':
-      m["skip"] += 1;
-      break;
-    // This base is a gap (--reverse-del suport)
-    // similar with Deletecount and deletecount, but with some difference
-    case '*':
-      M["gap"] += 1;
-      break;
-    case '#':
-      m["gap"] += 1;
-      break;
-    // Insertion
-    case '+':
-      i++;
-      // 48 is number '0', 57 is number '9'
-      while (bases[i] >= 48 && bases[i] <= 57) {
-        indelsize_string = indelsize_string + bases[i];
-        i = i + 1;
-      }
-      indelsize_int = str_to_num(indelsize_string);
-      indelseq = bases.substr(i, indelsize_int);
-      if (isupper(bases[i])) {
-        M["insert"] += 1;
-        Istat[indelseq]++;
-      } else {
-        m["insert"] += 1;
-        istat[indelseq]++;
-      }
-      i += indelsize_int - 1;
-      break;
-    // Deletion
-    case '-':
-      i++;
-      // 48 is number '0', 57 is number '9'
-      while (bases[i] >= 48 && bases[i] <= 57) {
-        indelsize_string = indelsize_string + bases[i];
-        i = i + 1;
-      }
-      indelsize_int = str_to_num(indelsize_string);
-      indelseq = bases.substr(i, indelsize_int);
-      if (isupper(bases[i])) {
-        M["delete"] += 1;
-        Dstat[indelseq]++;
-      } else {
-        m["delete"] += 1;
-        dstat[indelseq]++;
-      }
-      i += indelsize_int - 1;
-      break;
-    // Beginning of read segment, Skip i and i + 1
-    // The ASCII of the character following `^' minus 33 gives the mapping
-    // quality.
-    case '^':
-      sstat += 1;
-      i = i + 1;
-      break;
-    // End of read segment, Skip i
-    // A symbol `$' marks the end of a read segment.
-    case '$':
-      estat += 1;
-      break;
-    default:
-      string err = "Unknown ref base: ";
-      err += base;
-      throw runtime_error(err);
+  vector<contig> contigs;
+  uint64_t file_size = 0;
+
+  // register a record of pos (1-based) starting at offset
+  void add(string_view chr, int pos, uint64_t offset) {
+    if (contigs.empty() || contigs.back().name != chr) {
+      contigs.push_back(contig{string(chr), {}});
+    }
+    vector<uint64_t> &offsets = contigs.back().offsets;
+    size_t bin = (pos - 1) >> bin_shift;
+    while (offsets.size() <= bin) {
+      offsets.push_back(offset);
+    }
+  }
+
+  void save(const string &path, uint64_t size) {
+    file_size = size;
+    ofstream out(path, ios::binary);
+    write_num(out, magic);
+    write_num(out, (uint32_t)bin_shift);
+    write_num(out, file_size);
+    write_num(out, (uint32_t)contigs.size());
+    for (auto &c : contigs) {
+      write_num(out, (uint32_t)c.name.size());
+      out.write(c.name.data(), c.name.size());
+      write_num(out, (uint64_t)c.offsets.size());
+      out.write((const char *)c.offsets.data(),
+                c.offsets.size() * sizeof(uint64_t));
+    }
+    if (!out) {
+      throw runtime_error("Can not write index file: " + path);
+    }
+  }
+
+  void load(const string &path) {
+    ifstream in(path, ios::binary);
+    uint32_t m = 0, shift = 0, n = 0;
+    read_num(in, m);
+    if (!in || m != magic) {
+      throw runtime_error("Invalid index file: " + path);
     }
+    read_num(in, shift);
+    read_num(in, file_size);
+    read_num(in, n);
+    bin_shift = shift;
+    contigs.resize(n);
+    for (auto &c : contigs) {
+      uint32_t len = 0;
+      uint64_t nbin = 0;
+      read_num(in, len);
+      c.name.resize(len);
+      in.read(&c.name[0], len);
+      read_num(in, nbin);
+      c.offsets.resize(nbin);
+      in.read((char *)c.offsets.data(), nbin * sizeof(uint64_t));
+    }
+    if (!in) {
+      throw runtime_error("Truncated index file: " + path);
+    }
+  }
+
+private:
+  template <typename T> static void write_num(ostream &out, T v) {
+    out.write((const char *)&v, sizeof(v));
   }
+  template <typename T> static void read_num(istream &in, T &v) {
+    in.read((char *)&v, sizeof(v));
+  }
+};
 
-  M["mut"] = M["a"] + M["c"] + M["g"] + M["t"];
-  M["coverage"] = M["ref"] + M["mut"];
+// Progress of a run: the last input site whose output is fully written
+struct checkpoint {
+  string chr;
+  int pos = 0;
+  uint64_t out_offset = 0, in_offset = 0;
+
+  bool load(const string &path) {
+    ifstream in(path);
+    string tag;
+    if (!(in >> tag) || tag != "cpup-checkpoint") {
+      return false;
+    }
+    if (!(in >> chr >> pos >> out_offset >> in_offset)) {
+      throw runtime_error("Invalid checkpoint file: " + path);
+    }
+    return true;
+  }
 
-  m["mut"] = m["a"] + m["c"] + m["g"] + m["t"];
-  m["coverage"] = m["ref"] + m["mut"];
+  // replace the checkpoint file atomically
+  void save(const string &path) const {
+    string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (fp == nullptr) {
+      throw io_error("Can not write checkpoint file: " + tmp);
+    }
+    fprintf(fp, "cpup-checkpoint\n%s\t%d\t%llu\t%llu\n", chr.c_str(), pos,
+            (unsigned long long)out_offset, (unsigned long long)in_offset);
+    bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+      throw io_error("Can not write checkpoint file: " + path);
+    }
+  }
+};
 
-  return make_tuple(M, m, Istat, istat, Dstat, dstat, sstat, estat);
+// Move stdin to the input offset of a checkpoint
+void skip_input(const checkpoint &ck) {
+  if (ck.in_offset == 0 || fseeko(stdin, ck.in_offset, SEEK_SET) == 0) {
+    return;
+  }
+  // not seekable (pipe), read through lines comparing only chr/pos
+  uint64_t skipped = 0;
+  string line, chr;
+  int pos = 0;
+  while (skipped < ck.in_offset && getline(cin, line)) {
+    skipped += line.size() + 1;
+  }
+  if (skipped != ck.in_offset || !split_site(line, chr, pos) ||
+      chr != ck.chr || pos != ck.pos) {
+    throw runtime_error("Input does not match checkpoint at " + ck.chr + ":" +
+                        to_string(ck.pos));
+  }
+}
+
+// Add the records of an existing output file to the index
+void reindex_output(const string &path, uint64_t size, position_index &index) {
+  ifstream in(path, ios::binary);
+  string line, chr;
+  int pos;
+  uint64_t offset = 0;
+  while (offset < size && getline(in, line)) {
+    if (!(offset == 0 && line.compare(0, 4, "chr\t") == 0) &&
+        split_site(line, chr, pos)) {
+      index.add(chr, pos, offset);
+    }
+    offset += line.size() + 1;
+  }
 }
 
-// Set the appropriate count for ref nucleotide
-map<string, int> fix_ref_counts(map<string, int> m, string &ref_base) {
-  switch (ref_base[0]) {
-  case 'A':
-  case 'a':
-    m["a"] = m["ref"];
-    break;
-  case 'C':
-  case 'c':
-    m["c"] = m["ref"];
-    break;
-  case 'G':
-  case 'g':
-    m["g"] = m["ref"];
-    break;
-  case 'T':
-  case 't':
-    m["t"] = m["ref"];
-    break;
-  case 'N':
-  case 'n':
-    m["n"] = m["ref"];
-    break;
-  // TODO: Deal with -,R,Y,K,M,S,W etc
-  default:
-    break;
-  }
-  return m;
+// Parse region in format of chr, chr:start or chr:start-end
+void parse_region(const string &region, string &chr, int &start, int &end) {
+  start = 1;
+  end = INT32_MAX;
+  size_t colon = region.rfind(':');
+  if (colon == string::npos) {
+    chr = region;
+    return;
+  }
+  chr = region.substr(0, colon);
+  string range = region.substr(colon + 1);
+  size_t dash = range.find('-');
+  start = atoi(range.substr(0, dash).c_str());
+  if (dash == string::npos) {
+    end = start;
+  } else if (dash + 1 < range.size()) {
+    end = atoi(range.substr(dash + 1).c_str());
+  }
+  if (start < 1 || end < start) {
+    throw runtime_error("Invalid region: " + region);
+  }
 }
 
-// Split the line into the required fields and parse
-mpileup_line process_mpileup_line(string line) {
-  stringstream ss(line);
-  mpileup_line ml;
-
-  int ncol = 0;
-  int nsample = 0;
-  string col;
-  while (getline(ss, col, '\t')) {
-    if (ncol == 0) {
-      // get chrosome ID
-      ml.chr = col;
-    } else if (ncol == 1) {
-      // get pos
-      ml.pos = str_to_num(col);
-    } else if (ncol == 2) {
-      // get ref_base
-      ml.ref_base = col;
+// Print records of the given regions with the position index
+int query_main(int argc, char *argv[]) {
+  bool hide_header = false;
+  string index_path;
+  vector<string> args;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-H") || !strcmp(argv[i], "--headerless")) {
+      hide_header = true;
+    } else if (!strcmp(argv[i], "-x") || !strcmp(argv[i], "--index")) {
+      if (i + 1 != argc) {
+        index_path = argv[i + 1];
+      }
+      i++;
+    } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+      usage();
+      return 0;
     } else {
-      int depth;
-      string bases, quals;
-      // get depth
-      depth = str_to_num(col);
-      // get bases
-      getline(ss, bases, '\t');
-      // get quals
-      getline(ss, quals, '\t');
-
-      map<string, int> Count, count, Istat, istat, Dstat, dstat;
-      int sstat, estat;
-      tie(Count, count, Istat, istat, Dstat, dstat, sstat, estat) =
-          parse_counts(bases, quals);
-      Count = fix_ref_counts(Count, ml.ref_base);
-      count = fix_ref_counts(count, ml.ref_base);
-      ml.depths.push_back(depth);
-      ml.Counts.push_back(Count);
-      ml.counts.push_back(count);
-      ml.Istats.push_back(Istat);
-      ml.istats.push_back(istat);
-      ml.Dstats.push_back(Dstat);
-      ml.dstats.push_back(dstat);
-      ml.sstats.push_back(sstat);
-      ml.estats.push_back(estat);
-      nsample++;
-    }
-    ncol++;
-  }
-  ml.nsample = nsample;
-  return ml;
+      args.push_back(argv[i]);
+    }
+  }
+  if (args.size() < 2) {
+    usage();
+    return 1;
+  }
+  string path = args[0];
+  if (index_path.empty()) {
+    index_path = path + ".cpi";
+  }
+
+  position_index index;
+  ifstream in(path, ios::binary);
+  try {
+    if (!in) {
+      throw runtime_error("Can not open file: " + path);
+    }
+    index.load(index_path);
+    in.seekg(0, ios::end);
+    if ((uint64_t)in.tellg() != index.file_size) {
+      throw runtime_error("Index does not match file: " + index_path);
+    }
+  } catch (const std::runtime_error &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+
+  string line;
+  if (!hide_header) {
+    in.seekg(0);
+    getline(in, line);
+    if (line.compare(0, 4, "chr\t") == 0) {
+      cout << line << '\n';
+    }
+  }
+  for (size_t r = 1; r < args.size(); r++) {
+    string chr, site_chr;
+    int start, end, pos;
+    try {
+      parse_region(args[r], chr, start, end);
+    } catch (const std::runtime_error &e) {
+      cerr << e.what() << endl;
+      return 1;
+    }
+    for (auto &c : index.contigs) {
+      size_t bin = (start - 1) >> index.bin_shift;
+      if (c.name != chr || bin >= c.offsets.size()) {
+        continue;
+      }
+      in.clear();
+      in.seekg(c.offsets[bin]);
+      while (getline(in, line) && split_site(line, site_chr, pos) &&
+             site_chr == chr && pos <= end) {
+        if (pos >= start) {
+          cout << line << '\n';
+        }
+      }
+    }
+  }
+  return 0;
 }
 
-vector<string> split_string(const string &i_str, const string &i_delim) {
-  vector<string> result;
+// Options of the command line
+struct cpup_options : options {
+  site_mask include_mask, exclude_mask;
+  string index_path;
+  string output_path;
+  string checkpoint_path;
+  bool two_pass = false;
+  string store_path;
+  bool rates_given = false;     // rates of --score binom
+  double max_depth_pct = -1;    // --max-depth as percentile
+};
 
-  size_t found = i_str.find(i_delim);
-  size_t startIndex = 0;
+// Parse test of --score, as binom[:rate,...] or fisher[:control]
+bool parse_score(const string &arg, cpup_options &opt) {
+  vector<string> fields = split_string(arg, ":");
+  try {
+    if (fields[0] == "binom") {
+      opt.score = binom_score;
+      if (fields.size() > 1) {
+        opt.error_rates.clear();
+        opt.rates_given = true;
+        for (auto &rate : split_string(fields[1], ",")) {
+          opt.error_rates.push_back(stod(rate));
+          if (opt.error_rates.back() <= 0 || opt.error_rates.back() >= 1) {
+            return false;
+          }
+        }
+      }
+    } else if (fields[0] == "fisher") {
+      opt.score = fisher_score;
+      // control sample is 1-based on the command line
+      opt.control = fields.size() > 1 ? stoi(fields[1]) - 1 : 0;
+      if (opt.control < 0) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  } catch (const std::logic_error &e) {
+    return false;
+  }
+  return fields.size() <= 2;
+}
 
-  while (found != string::npos) {
-    result.push_back(string(i_str.begin() + startIndex, i_str.begin() + found));
-    startIndex = found + i_delim.size();
-    found = i_str.find(i_delim, startIndex);
+// Parse filter of p-value, as pval:cutoff or pval<cutoff
+bool parse_pval_filter(const string &filter, double &cutoff) {
+  if (filter.compare(0, 4, "pval") != 0 || filter.size() < 6 ||
+      (filter[4] != ':' && filter[4] != '<')) {
+    return false;
   }
-  if (startIndex != i_str.size())
-    result.push_back(string(i_str.begin() + startIndex, i_str.end()));
-  return result;
+  cutoff = stod(filter.substr(5));
+  return true;
 }
 
-int main(int argc, char *argv[]) {
-  bool hide_header = false;
-  bool to_upper = false;
-  bool reverse_strand = false;
-  bool stat_ends = false;
-  bool stat_indel = false;
-  bool hide_strand = false;
-  bool by_strand = false;
-  bool major_strand = false;
-  vector<string> count_names = {};
-  map<string, int> any_cutoffs; // check any (max) value greater than cutoff
-  map<string, int> all_cutoffs; // check all (min) value greater than cutoff
+// Parse the command line into options, other arguments are kept in args.
+// Return the exit code when the program should stop, otherwise -1.
+int parse_options(int argc, char *argv[], cpup_options &opt,
+                  vector<string> &args) {
   for (int i = 1; i < argc; i++) {
     if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
       usage();
       return 0;
     } else if (!strcmp(argv[i], "-H") || !strcmp(argv[i], "--headerless")) {
-      hide_header = true;
+      opt.hide_header = true;
     } else if (!strcmp(argv[i], "-U") || !strcmp(argv[i], "--toupper")) {
-      to_upper = true;
+      opt.to_upper = true;
     } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--reverese")) {
-      reverse_strand = true;
+      opt.reverse_strand = true;
     } else if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "--indel")) {
-      stat_indel = true;
+      opt.stat_indel = true;
     } else if (!strcmp(argv[i], "-e") || !strcmp(argv[i], "--ends")) {
-      stat_ends = true;
+      opt.stat_ends = true;
     } else if (!strcmp(argv[i], "-S") || !strcmp(argv[i], "--strandless")) {
-      hide_strand = true;
+      opt.hide_strand = true;
     } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--by-strand")) {
-      by_strand = true;
+      opt.by_strand = true;
     } else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--major-strand")) {
-      major_strand = true;
+      opt.major_strand = true;
+    } else if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--mapq")) {
+      opt.read_opt.mapq_hist = true;
+    } else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--read-pos")) {
+      opt.read_opt.bp_hist = true;
+    } else if (!strcmp(argv[i], "--input-MAPQ")) {
+      opt.read_opt.has_mapq = true;
+    } else if (!strcmp(argv[i], "--input-BP")) {
+      opt.read_opt.has_bp = true;
+    } else if (!strcmp(argv[i], "--trim-bp")) {
+      if (i + 1 != argc) {
+        opt.read_opt.trim_bp = std::stoi(argv[i + 1]);
+      }
+      i++;
     } else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--count")) {
       if (i + 1 != argc) {
-        count_names = split_string(argv[i + 1], ",");
+        opt.count_names = split_string(argv[i + 1], ",");
       }
       i++;
     } else if (!strcmp(argv[i], "-f") || !strcmp(argv[i], "--filter")) {
@@ -715,11 +536,14 @@ int main(int argc, char *argv[]) {
       if (i + 1 != argc) {
         vector<string> filters = split_string(argv[i + 1], ",");
         for (auto &s : filters) {
+          if (parse_pval_filter(s, opt.any_pval)) {
+            continue;
+          }
           vector<string> filter = split_string(s, ":");
           // mut, ref, coverage, gap...
           string filter_name = filter[0];
           int min_cutoff = std::stoi(filter[1]);
-          any_cutoffs[filter_name] = min_cutoff;
+          opt.any_cutoffs[filter_name] = min_cutoff;
         }
       }
       i++;
@@ -728,189 +552,1056 @@ int main(int argc, char *argv[]) {
       if (i + 1 != argc) {
         vector<string> filters = split_string(argv[i + 1], ",");
         for (auto &s : filters) {
+          if (parse_pval_filter(s, opt.all_pval)) {
+            continue;
+          }
           vector<string> filter = split_string(s, ":");
           // mut, ref, coverage, gap...
           string filter_name = filter[0];
           int min_cutoff = std::stoi(filter[1]);
-          all_cutoffs[filter_name] = min_cutoff;
+          opt.all_cutoffs[filter_name] = min_cutoff;
+        }
+      }
+      i++;
+    } else if (!strcmp(argv[i], "-x") || !strcmp(argv[i], "--index")) {
+      if (i + 1 != argc) {
+        opt.index_path = argv[i + 1];
+      }
+      i++;
+    } else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
+      if (i + 1 != argc) {
+        opt.output_path = argv[i + 1];
+      }
+      i++;
+    } else if (!strcmp(argv[i], "--checkpoint")) {
+      if (i + 1 != argc) {
+        opt.checkpoint_path = argv[i + 1];
+      }
+      i++;
+    } else if (!strcmp(argv[i], "--score")) {
+      if (i + 1 == argc || !parse_score(argv[i + 1], opt)) {
+        cerr << "\n"
+                "The `--score` parameter requires binom[:rate,...] or "
+                "fisher[:control]"
+             << endl;
+        return 1;
+      }
+      i++;
+    } else if (!strcmp(argv[i], "--rle")) {
+      opt.rle = true;
+    } else if (!strcmp(argv[i], "--two-pass")) {
+      opt.two_pass = true;
+    } else if (!strcmp(argv[i], "--store")) {
+      if (i + 1 != argc) {
+        opt.store_path = argv[i + 1];
+      }
+      i++;
+    } else if (!strcmp(argv[i], "--max-depth")) {
+      // depth or percentile of depth, as 500 or p99
+      try {
+        string arg = i + 1 != argc ? argv[i + 1] : "";
+        if (!arg.empty() && arg[0] == 'p') {
+          opt.max_depth_pct = stod(arg.substr(1));
+        } else {
+          opt.max_depths = {stoi(arg)};
         }
+      } catch (const std::logic_error &e) {
+        cerr << "\n"
+                "The `--max-depth` parameter requires a depth or a "
+                "percentile (p99)"
+             << endl;
+        return 1;
       }
       i++;
+    } else if (!strcmp(argv[i], "--mask-exclude") ||
+               !strcmp(argv[i], "--mask-include")) {
+      if (i + 1 == argc) {
+        cerr << "\n"
+                "The `"
+             << argv[i] << "` parameter requires a BED or VCF file" << endl;
+        return 1;
+      }
+      try {
+        if (!strcmp(argv[i], "--mask-exclude")) {
+          opt.exclude_mask.load(argv[i + 1]);
+        } else {
+          opt.include_mask.load(argv[i + 1]);
+        }
+      } catch (const std::runtime_error &e) {
+        cerr << e.what() << endl;
+        return 1;
+      }
+      i++;
+    } else {
+      args.push_back(argv[i]);
     }
   }
 
-  if (by_strand and hide_strand) {
+  if (opt.by_strand and opt.hide_strand) {
     cerr << "\n"
             "Can not use the `--by_strand (-s)` parameter together with "
             "the `--strandless (-S)` parameter"
          << endl;
     return 1;
   }
-  if (!by_strand and major_strand) {
+  if (!opt.by_strand and opt.major_strand) {
     cerr << "\n"
             "The `--major-strand (-m)` parameter must be used together with "
             "the `--by-strand (-s)` parameter"
          << endl;
     return 1;
   }
-  if (!hide_strand and stat_ends) {
+  if (!opt.hide_strand and opt.stat_ends) {
     cerr << "\n"
             "The `--ends (-e)` parameter must be used together with "
             "the `--strandless (-S)` parameter"
          << endl;
     return 1;
   }
-  if (!hide_strand and reverse_strand) {
+  if (!opt.hide_strand and
+      (opt.read_opt.mapq_hist or opt.read_opt.bp_hist)) {
+    cerr << "\n"
+            "The `--mapq (-q)` and `--read-pos (-p)` parameters must be used "
+            "together with the `--strandless (-S)` parameter"
+         << endl;
+    return 1;
+  }
+  if (!opt.read_opt.has_bp and
+      (opt.read_opt.bp_hist or opt.read_opt.trim_bp > 0)) {
+    cerr << "\n"
+            "The `--read-pos (-p)` and `--trim-bp` parameters require "
+            "the `--input-BP` parameter"
+         << endl;
+    return 1;
+  }
+  if (!opt.hide_strand and opt.reverse_strand) {
     cerr << "\n"
             "The `--reverse (-r)` parameter must be used together with "
             "the `--strandless (-S)` parameter"
          << endl;
     return 1;
   }
+  if ((opt.any_pval >= 0 || opt.all_pval >= 0) && opt.score == no_score) {
+    cerr << "\n"
+            "The `pval` filter must be used together with "
+            "the `--score` parameter"
+         << endl;
+    return 1;
+  }
+  if (opt.rle && (!opt.index_path.empty() || !opt.checkpoint_path.empty())) {
+    cerr << "\n"
+            "The `--rle` parameter can not be used with `--index (-x)` or "
+            "`--checkpoint`"
+         << endl;
+    return 1;
+  }
+  // a run keeps only depths, not strands, ends, indels or histograms
+  if (opt.rle && (opt.by_strand || opt.stat_ends || opt.stat_indel ||
+                  opt.read_opt.mapq_hist || opt.read_opt.bp_hist)) {
+    cerr << "\n"
+            "The `--rle` parameter can not be used with `--by-strand (-s)`, "
+            "`--ends (-e)`, `--indel (-i)`, `--mapq (-q)` or `--read-pos (-p)`"
+         << endl;
+    return 1;
+  }
+  if (opt.max_depth_pct >= 0 && !opt.two_pass) {
+    cerr << "\n"
+            "The percentile of `--max-depth` must be used together with "
+            "the `--two-pass` parameter"
+         << endl;
+    return 1;
+  }
+  if (!opt.store_path.empty() && !opt.two_pass) {
+    cerr << "\n"
+            "The `--store` parameter must be used together with "
+            "the `--two-pass` parameter"
+         << endl;
+    return 1;
+  }
+  if (opt.two_pass && !opt.checkpoint_path.empty()) {
+    cerr << "\n"
+            "The `--checkpoint` parameter can not be used with `--two-pass`"
+         << endl;
+    return 1;
+  }
+  if (!opt.checkpoint_path.empty() && opt.output_path.empty()) {
+    cerr << "\n"
+            "The `--checkpoint` parameter must be used together with "
+            "the `--output (-o)` parameter"
+         << endl;
+    return 1;
+  }
+  return -1;
+}
 
+// Set thresholds from the stats of pass one, then filter and print the sites
+// of the store
+void second_pass(FILE *fp, const site_stats &stats, cpup_options opt,
+                 ostream &out, const function<uint64_t()> &offset,
+                 position_index *index) {
+  for (size_t i = 0; i < stats.samples(); i++) {
+    if (opt.score == binom_score && !opt.rates_given) {
+      opt.error_rates.resize(i + 1);
+      opt.error_rates[i] = stats.background_rate(i);
+    }
+    if (opt.max_depth_pct >= 0) {
+      opt.max_depths.resize(i + 1);
+      opt.max_depths[i] = stats.depth_percentile(i, opt.max_depth_pct);
+    }
+    cerr << "Sample " << i + 1 << ": background rate "
+         << stats.background_rate(i) << ", depth p50 "
+         << stats.depth_percentile(i, 50) << ", p99 "
+         << stats.depth_percentile(i, 99) << endl;
+  }
+  rewind(fp);
+  store_reader reader(fp);
+  formatter fmt(opt);
+  const site_view *site;
+  while (reader.next(site)) {
+    uint64_t start = offset();
+    if (fmt.print_site(*site, out) && index != nullptr) {
+      index->add(site->chr, site->pos, start);
+    }
+  }
+  fmt.finish(out);
+}
+
+// Skip masked sites before parsing the sample columns
+void set_masks(parser &p, cpup_options &opt) {
+  if (opt.include_mask.empty() && opt.exclude_mask.empty()) {
+    return;
+  }
+  p.set_filter([&opt](string_view chr, int pos) {
+    return (opt.include_mask.empty() || opt.include_mask.contains(chr, pos)) &&
+           !opt.exclude_mask.contains(chr, pos);
+  });
+}
+
+// A region of the genome for one mpileup worker (0-based, half-open)
+struct shard {
+  shard(const string &chr, int start, int end)
+      : chr(chr), start(start), end(end) {}
+
+  string chr;
+  int start, end;
+  FILE *out = nullptr; // formatted output of the region, in a temporary file
+  string error;
+  bool done = false;
+};
+
+// Split the contigs in .fai, or the BED intervals on them, into regions of
+// about equal size in genome order, and at most shard_max bases. Regions do
+// not overlap, so each site is piled up by exactly one worker.
+vector<shard> plan_shards(const string &fai_path, const string &bed_path,
+                          int nshard) {
+  vector<pair<string, int>> contigs;
+  map<string, vector<pair<int, int>>> intervals;
+  ifstream fai(fai_path);
+  if (!fai) {
+    throw runtime_error("Can not open fasta index: " + fai_path);
+  }
   string line;
-  getline(cin, line);
+  while (getline(fai, line)) {
+    vector<string> cols = split_string(line, "\t");
+    if (cols.size() >= 2) {
+      contigs.emplace_back(cols[0], atoi(cols[1].c_str()));
+    }
+  }
+  if (bed_path.empty()) {
+    for (auto &c : contigs) {
+      intervals[c.first].emplace_back(0, c.second);
+    }
+  } else {
+    ifstream bed(bed_path);
+    if (!bed) {
+      throw runtime_error("Can not open bed file: " + bed_path);
+    }
+    while (getline(bed, line)) {
+      // columns might be separated by spaces
+      stringstream ss(line);
+      string chr;
+      int start, end;
+      if (line.empty() || line[0] == '#' || !(ss >> chr >> start >> end)) {
+        continue;
+      }
+      if (end > start) {
+        intervals[chr].emplace_back(start, end);
+      }
+    }
+  }
 
-  // print header
-  if (!hide_header) {
+  // merge intervals and count the total size
+  int64_t total = 0;
+  for (auto &c : intervals) {
+    merge_intervals(c.second);
+    for (auto &i : c.second) {
+      total += i.second - i.first;
+    }
+  }
+
+  // a small region keeps the output waiting for the writer small too
+  const int64_t shard_max = 4 << 20;
+  int64_t target =
+      max<int64_t>(1, min<int64_t>((total + nshard - 1) / nshard, shard_max));
+  vector<shard> shards;
+  for (auto &c : contigs) {
+    auto iter = intervals.find(c.first);
+    if (iter == intervals.end() || iter->second.empty()) {
+      continue;
+    }
+    const vector<pair<int, int>> &iv = iter->second;
+    int start = iv.front().first;
+    int64_t size = 0;
+    for (auto &i : iv) {
+      int p = i.first;
+      while (size + (i.second - p) >= target) {
+        int cut = p + (target - size);
+        shards.emplace_back(c.first, start, cut);
+        start = p = cut;
+        size = 0;
+      }
+      size += i.second - p;
+    }
+    if (size > 0) {
+      shards.emplace_back(c.first, start, iv.back().second);
+    }
+  }
+  return shards;
+}
+
+// Quote an argument for the shell
+string shell_quote(const string &s) {
+  string q = "'";
+  for (char c : s) {
+    if (c == '\'') {
+      q += "'\\''";
+    } else {
+      q += c;
+    }
+  }
+  return q + "'";
+}
+
+// Pile up a region with samtools and keep the formatted output
+void run_shard(shard &s, const string &command, cpup_options &opt) {
+  string region = s.chr + ":" + to_string(s.start + 1) + "-" + to_string(s.end);
+  string cmd = command + " -r " + shell_quote(region);
+  s.out = tmpfile();
+  if (s.out == nullptr) {
+    s.error = "Can not open temporary file";
+    return;
+  }
+  FILE *fp = popen(cmd.c_str(), "r");
+  if (fp == nullptr) {
+    s.error = "Can not run: " + cmd;
+    return;
+  }
+  counting_buf obuf(fileno(s.out));
+  ostream out(&obuf);
+  formatter fmt(opt);
+  parser p(opt.read_opt,
+           [&](const site_view &site) { fmt.print_site(site, out); });
+  set_masks(p, opt);
+  char buf[1 << 16];
+  size_t n;
+  try {
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+      p.feed(buf, n);
+    }
+    p.finish();
+    fmt.finish(out);
+  } catch (const std::runtime_error &e) {
+    s.error = string(e.what()) + "\nError parsing line " + string(p.line());
+    // drain the pipe so that samtools is not killed by SIGPIPE
+    while (fread(buf, 1, sizeof(buf), fp) > 0) {
+    }
+  }
+  int status = pclose(fp);
+  if (s.error.empty() && status != 0) {
+    s.error = "samtools failed on region " + region;
+  }
+  if (s.error.empty() && !out.flush()) {
+    s.error = "Can not write temporary file";
+  }
+}
+
+// Copy the output of a shard, adding its sites to the index if any
+bool copy_shard(FILE *fp, ostream &out, const counting_buf &obuf,
+                position_index *index) {
+  rewind(fp);
+  if (index == nullptr) {
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+      out.write(buf, n);
+    }
+    return !ferror(fp);
+  }
+  char *line = nullptr;
+  size_t cap = 0;
+  ssize_t len;
+  string chr;
+  int pos;
+  while ((len = ::getline(&line, &cap, fp)) > 0) {
+    if (split_site(string_view(line, len), chr, pos)) {
+      index->add(chr, pos, obuf.bytes());
+    }
+    out.write(line, len);
+  }
+  free(line);
+  return !ferror(fp);
+}
+
+// Pile up regions with parallel samtools workers, print in genome order
+int run_main(int argc, char *argv[]) {
+  string samtools = "samtools";
+  string mpileup_args = "-d 0 -Q 10 --reverse-del";
+  string fasta, bed;
+  int jobs = max(1u, thread::hardware_concurrency());
+  vector<char *> rest = {argv[0]};
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 < argc && !strcmp(argv[i], "--ref")) {
+      fasta = argv[++i];
+    } else if (i + 1 < argc && !strcmp(argv[i], "--bed")) {
+      bed = argv[++i];
+    } else if (i + 1 < argc &&
+               (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs"))) {
+      jobs = max(1, atoi(argv[++i]));
+    } else if (i + 1 < argc && !strcmp(argv[i], "--samtools")) {
+      samtools = argv[++i];
+    } else if (i + 1 < argc && !strcmp(argv[i], "--mpileup-args")) {
+      mpileup_args = argv[++i];
+    } else {
+      rest.push_back(argv[i]);
+    }
+  }
+  cpup_options opt;
+  vector<string> bams;
+  int ret = parse_options(rest.size(), rest.data(), opt, bams);
+  if (ret >= 0) {
+    return ret;
+  }
+  if (fasta.empty() || bams.empty()) {
+    cerr << "\n"
+            "The `run` command requires `--ref <.fa>` and <.bam> files"
+         << endl;
+    return 1;
+  }
+  if (!opt.checkpoint_path.empty() || opt.two_pass || opt.rle) {
+    cerr << "\n"
+            "The `--checkpoint`, `--two-pass` and `--rle` parameters can not "
+            "be used with `run`"
+         << endl;
+    return 1;
+  }
+
+  vector<shard> shards;
+  try {
+    shards = plan_shards(fasta + ".fai", bed, jobs * 4);
+  } catch (const std::runtime_error &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  string command = shell_quote(samtools) + " mpileup " + mpileup_args +
+                   " -f " + shell_quote(fasta);
+  if (!bed.empty()) {
+    command += " -l " + shell_quote(bed);
+  }
+  for (auto &b : bams) {
+    command += " " + shell_quote(b);
+  }
+
+  int out_fd;
+  try {
+    out_fd = open_output(opt.output_path);
+  } catch (const std::runtime_error &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  counting_buf obuf(out_fd);
+  ostream out(&obuf);
+  if (!opt.hide_header) {
+    // header from an empty site of all samples
+    string empty = "chr\t1\tN";
+    for (size_t i = 0; i < bams.size(); i++) {
+      empty += "\t0\t*\t*";
+      empty += opt.read_opt.has_mapq ? "\t*" : "";
+      empty += opt.read_opt.has_bp ? "\t*" : "";
+    }
+    parser p(opt.read_opt);
+    formatter(opt).print_header(p.parse(empty), out);
+  }
+
+  // workers take shards in order, at most `window` ahead of the writer
+  mutex mtx;
+  condition_variable cv;
+  size_t next = 0, written = 0, window = jobs * 2;
+  bool failed = false;
+  vector<thread> workers;
+  for (int w = 0; w < jobs; w++) {
+    workers.emplace_back([&]() {
+      cpup_options worker_opt = opt;
+      while (true) {
+        size_t k;
+        {
+          unique_lock<mutex> lock(mtx);
+          cv.wait(lock, [&]() {
+            return failed || next >= shards.size() || next < written + window;
+          });
+          if (failed || next >= shards.size()) {
+            return;
+          }
+          k = next++;
+        }
+        run_shard(shards[k], command, worker_opt);
+        {
+          lock_guard<mutex> lock(mtx);
+          shards[k].done = true;
+        }
+        cv.notify_all();
+      }
+    });
+  }
+
+  position_index index;
+  for (size_t k = 0; k < shards.size(); k++) {
+    {
+      unique_lock<mutex> lock(mtx);
+      cv.wait(lock, [&]() { return shards[k].done; });
+      if (!shards[k].error.empty()) {
+        cerr << shards[k].error << endl;
+        failed = true;
+      }
+    }
+    bool copied = failed || copy_shard(shards[k].out, out, obuf,
+                                       opt.index_path.empty() ? nullptr
+                                                              : &index);
+    {
+      lock_guard<mutex> lock(mtx);
+      if (!copied) {
+        cerr << "Can not read temporary file" << endl;
+        failed = true;
+      }
+      written = k + 1;
+    }
+    cv.notify_all();
+    if (failed) {
+      break;
+    }
+    fclose(shards[k].out);
+    shards[k].out = nullptr;
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+  for (auto &s : shards) {
+    if (s.out != nullptr) {
+      fclose(s.out);
+    }
+  }
+  out.flush();
+  if (failed) {
+    return 1;
+  }
+  if (!opt.index_path.empty()) {
     try {
-      mpileup_line ml = process_mpileup_line(line);
-      ml.count_names = count_names;
-      ml.print_header(ml.nsample, cout, stat_indel, stat_ends, hide_strand,
-                      by_strand);
+      index.save(opt.index_path, obuf.bytes());
     } catch (const std::runtime_error &e) {
       cerr << e.what() << endl;
-      cerr << "\nError parsing line " << line;
+      return 1;
     }
   }
+  return 0;
+}
 
-  // parse and print each line
-  while (cin) {
-    try {
-      mpileup_line ml = process_mpileup_line(line);
-      ml.count_names = count_names;
-      if (to_upper) {
-        std::transform(ml.ref_base.begin(), ml.ref_base.end(),
-                       ml.ref_base.begin(),
-                       [](unsigned char c) { return ::toupper(c); });
-      }
-      if (reverse_strand) {
-        std::transform(ml.ref_base.begin(), ml.ref_base.end(),
-                       ml.ref_base.begin(),
-                       [](unsigned char c) { return basemap[c]; });
-        for (int i = 0; i < ml.nsample; i++) {
-          ml.Counts[i] = switch_complement_counts(ml.Counts[i]);
-          ml.counts[i] = switch_complement_counts(ml.counts[i]);
-          // ml.ref_base = basemap[ml.ref_base[0]];
+// Order of contigs in .fai
+map<string, int, less<>> load_contig_order(const string &fai_path) {
+  ifstream fai(fai_path);
+  if (!fai) {
+    throw runtime_error("Can not open fasta index: " + fai_path);
+  }
+  map<string, int, less<>> order;
+  string line;
+  while (getline(fai, line)) {
+    string chr = line.substr(0, line.find('\t'));
+    if (!chr.empty()) {
+      order.emplace(chr, order.size());
+    }
+  }
+  return order;
+}
+
+// Add the samples of a new mpileup to an existing output (or site store),
+// joined on (chr, pos) in genome order
+int merge_main(int argc, char *argv[]) {
+  string fai_path, store_path;
+  vector<char *> rest = {argv[0]};
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 < argc && !strcmp(argv[i], "--fai")) {
+      fai_path = argv[++i];
+    } else if (i + 1 < argc && !strcmp(argv[i], "--store")) {
+      store_path = argv[++i];
+    } else {
+      rest.push_back(argv[i]);
+    }
+  }
+  cpup_options opt;
+  vector<string> args;
+  int ret = parse_options(rest.size(), rest.data(), opt, args);
+  if (ret >= 0) {
+    return ret;
+  }
+  if (fai_path.empty() || args.size() != 1) {
+    cerr << "\n"
+            "The `merge` command requires `--fai <.fai>` and an existing "
+            "output or store"
+         << endl;
+    return 1;
+  }
+  if (opt.by_strand || !opt.count_names.empty() || opt.rle) {
+    cerr << "\n"
+            "The `--by-strand (-s)`, `--count (-c)` and `--rle` parameters can "
+            "not be used with `merge`"
+         << endl;
+    return 1;
+  }
+  if (!opt.checkpoint_path.empty() || opt.two_pass ||
+      !opt.include_mask.empty() || !opt.exclude_mask.empty()) {
+    cerr << "\n"
+            "The `--checkpoint`, `--two-pass` and mask parameters can not be "
+            "used with `merge`"
+         << endl;
+    return 1;
+  }
+
+  int out_fd;
+  try {
+    out_fd = open_output(opt.output_path);
+  } catch (const std::runtime_error &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  counting_buf obuf(out_fd);
+  ostream out(&obuf);
+  position_index index;
+  try {
+    map<string, int, less<>> order = load_contig_order(fai_path);
+    string last_chr;
+    int last_rank = -1;
+    // position of a site in genome order
+    auto key = [&](string_view chr, int pos) {
+      if (chr != last_chr) {
+        auto it = order.find(chr);
+        if (it == order.end()) {
+          throw runtime_error("Contig " + string(chr) +
+                              " is not in fasta index");
         }
+        last_chr.assign(chr);
+        last_rank = it->second;
       }
-      if (by_strand) {
-        vector<bool> is_passed = {true, true};
-        for (auto iter = any_cutoffs.begin(); iter != any_cutoffs.end();
-             ++iter) {
-          bool filters_result_fwd = false;
-          bool filters_result_rev = false;
-          string filter_name = iter->first;
-          int min_cutoff = iter->second;
-          for (int i = 0; i < ml.nsample; i++) {
-            if (ml.Counts[i][filter_name] >= min_cutoff) {
-              filters_result_fwd = true;
-              break;
-            }
-          }
-          for (int i = 0; i < ml.nsample; i++) {
-            if (ml.counts[i][filter_name] >= min_cutoff) {
-              filters_result_rev = true;
-              break;
-            }
-          }
-          is_passed[0] = is_passed[0] && filters_result_fwd;
-          is_passed[1] = is_passed[1] && filters_result_rev;
-        }
-        for (auto iter = all_cutoffs.begin(); iter != all_cutoffs.end();
-             ++iter) {
-          bool filters_result_fwd = true;
-          bool filters_result_rev = true;
-          string filter_name = iter->first;
-          int min_cutoff = iter->second;
-          for (int i = 0; i < ml.nsample; i++) {
-            if (ml.Counts[i][filter_name] < min_cutoff) {
-              filters_result_fwd = false;
-              break;
-            }
-          }
-          for (int i = 0; i < ml.nsample; i++) {
-            if (ml.counts[i][filter_name] < min_cutoff) {
-              filters_result_rev = false;
-              break;
-            }
-          }
-          is_passed[0] = is_passed[0] && filters_result_fwd;
-          is_passed[1] = is_passed[1] && filters_result_rev;
+      return make_pair(last_rank, pos);
+    };
+
+    // existing sites, from a site store or text output with header
+    FILE *old_fp = fopen(args[0].c_str(), "rb");
+    if (old_fp == nullptr) {
+      throw runtime_error("Can not open existing output: " + args[0]);
+    }
+    char magic[4] = {};
+    bool is_store = fread(magic, 1, 4, old_fp) == 4 && !memcmp(magic, "CPS\1", 4);
+    rewind(old_fp);
+    unique_ptr<store_reader> old_store;
+    ifstream old_text;
+    unique_ptr<record_parser> records;
+    string old_line;
+    size_t nold = 0;
+    formatter fmt(opt);
+    if (is_store) {
+      old_store.reset(new store_reader(old_fp));
+      nold = old_store->first_samples();
+    } else {
+      fclose(old_fp);
+      old_fp = nullptr;
+      old_text.open(args[0], ios::binary);
+      if (!getline(old_text, old_line) || old_line.compare(0, 4, "chr\t")) {
+        throw runtime_error("Existing output has no header: " + args[0]);
+      }
+      // the layout must be the same as the merged one, p-values are tested
+      // again if any
+      nold = count(old_line.begin(), old_line.end(), '\t') - 2;
+      vector<sample_counts> empty(nold);
+      site_view site;
+      site.samples = {empty.data(), empty.data() + nold};
+      options layout = opt;
+      for (score_method score : {opt.score, no_score}) {
+        layout.score = score;
+        ostringstream header;
+        formatter(layout).print_header(site, header);
+        if (header.str() == old_line + "\n") {
+          records.reset(new record_parser(layout));
+          break;
         }
-        // drop minor strand
-        if (major_strand) {
-          int coverage_fwd = 0;
-          int coverage_rev = 0;
-          for (int i = 0; i < ml.nsample; i++) {
-            coverage_fwd += ml.Counts[i]["coverage"];
-            coverage_rev += ml.counts[i]["coverage"];
-          }
-          if (coverage_fwd > coverage_rev) {
-            is_passed[1] = false;
-          } else if (coverage_fwd < coverage_rev) {
-            is_passed[0] = false;
+      }
+      if (!records) {
+        throw runtime_error("Existing output has different columns than "
+                            "the options: " + args[0]);
+      }
+    }
+    // without filters or p-values, which need the counts of all samples,
+    // existing records are copied as they are, and only new samples are
+    // formatted
+    bool copy_old = records && store_path.empty() && opt.score == no_score &&
+                    opt.any_cutoffs.empty() && opt.all_cutoffs.empty() &&
+                    opt.max_depths.empty();
+    pair<int, int> old_key(-1, 0);
+    const site_view *old = nullptr;
+    bool has_old = false;
+    string old_chr;
+    int old_pos = 0;
+    auto next_old = [&]() {
+      old = nullptr;
+      has_old = false;
+      if (old_store) {
+        has_old = old_store->next(old);
+      } else if (getline(old_text, old_line)) {
+        has_old = true;
+        if (copy_old) {
+          if ((size_t)count(old_line.begin(), old_line.end(), '\t') !=
+                  nold + 2 ||
+              !split_site(old_line, old_chr, old_pos)) {
+            throw runtime_error("Invalid record: " + old_line);
           }
+        } else {
+          old = &records->parse(old_line);
         }
-        if (is_passed[0] and is_passed[1]) {
-          ml.print_counter(cout, stat_indel, stat_ends, hide_strand, by_strand,
-                           '*');
-        } else if (is_passed[0] and !is_passed[1]) {
-          ml.print_counter(cout, stat_indel, stat_ends, hide_strand, by_strand,
-                           '+');
-        } else if (!is_passed[0] and is_passed[1]) {
-          ml.print_counter(cout, stat_indel, stat_ends, hide_strand, by_strand,
-                           '-');
+      }
+      if (old != nullptr) {
+        old_chr.assign(old->chr);
+        old_pos = old->pos;
+      }
+      if (has_old) {
+        auto k = key(old_chr, old_pos);
+        if (k <= old_key) {
+          throw runtime_error("Existing output is not sorted at " + old_chr +
+                              ":" + to_string(old_pos));
         }
+        old_key = k;
+      }
+    };
+
+    // the first line gives the number of new samples
+    vector<char> buf(1 << 20);
+    string first = read_first_line(buf);
+    size_t n;
+    parser p(opt.read_opt);
+    size_t nnew = 0;
+    if (!first.empty()) {
+      nnew = p.parse(string_view(first).substr(0, first.find('\n')))
+                 .samples.size();
+    }
+
+    // empty samples fill the sites missing in one side
+    vector<int> zeros(mapq_bins.size() + bp_bins.size());
+    sample_counts zero;
+    if (opt.read_opt.mapq_hist) {
+      zero.mapq_hist = {zeros.data(), zeros.data() + mapq_bins.size()};
+    }
+    if (opt.read_opt.bp_hist) {
+      zero.bp_hist = {zeros.data(), zeros.data() + bp_bins.size()};
+    }
+    vector<sample_counts> merged(nold + nnew, zero);
+    site_view site;
+    site.samples = {merged.data(), merged.data() + merged.size()};
+    if (!opt.hide_header) {
+      fmt.print_header(site, out);
+    }
+    unique_ptr<store_writer> store;
+    FILE *store_fp = nullptr;
+    if (!store_path.empty()) {
+      store_fp = fopen(store_path.c_str(), "wb");
+      if (store_fp == nullptr) {
+        throw runtime_error("Can not open site store: " + store_path);
+      }
+      store.reset(new store_writer(store_fp, opt.read_opt));
+    }
+    auto emit = [&](const site_view *a, const site_view *b) {
+      const site_view &from = b ? *b : *a;
+      site.chr = from.chr;
+      site.pos = from.pos;
+      site.ref = from.ref;
+      for (size_t i = 0; i < nold; i++) {
+        merged[i] = a ? a->samples[i] : zero;
+      }
+      for (size_t i = 0; i < nnew; i++) {
+        merged[nold + i] = b ? b->samples[i] : zero;
+      }
+      if (store) {
+        store->add(site);
+      }
+      uint64_t offset = obuf.bytes();
+      if (fmt.print_site(site, out) && !opt.index_path.empty()) {
+        index.add(site.chr, site.pos, offset);
+      }
+    };
+
+    // a site of new samples as printed, split into chr, pos and ref, and the
+    // counts of samples
+    formatter fmt_new(opt);
+    ostringstream printed;
+    string head, counts;
+    auto print_new = [&](const site_view &s) {
+      printed.str("");
+      fmt_new.print_site(s, printed);
+      string line = printed.str();
+      size_t tab = line.find('\t', line.find('\t', line.find('\t') + 1) + 1);
+      head.assign(line, 0, tab);
+      counts.assign(line, tab, line.size() - tab - 1);
+    };
+    // counts of samples without reads, for the sites missing in one side
+    string zero_old, zero_new;
+    if (copy_old) {
+      vector<sample_counts> zeros_of(max(nold, nnew), zero);
+      site_view empty;
+      empty.samples = {zeros_of.data(), zeros_of.data() + nold};
+      print_new(empty);
+      zero_old = counts;
+      empty.samples = {zeros_of.data(), zeros_of.data() + nnew};
+      print_new(empty);
+      zero_new = counts;
+    }
+    auto copy = [&](bool with_old, const site_view *b) {
+      uint64_t offset = obuf.bytes();
+      if (b != nullptr) {
+        print_new(*b);
+      }
+      if (with_old) {
+        out << old_line << (b != nullptr ? counts : zero_new) << '\n';
       } else {
-        bool are_passed = true;
-        for (auto iter = any_cutoffs.begin(); iter != any_cutoffs.end();
-             ++iter) {
-          bool filters_result = false;
-          string filter_name = iter->first;
-          int min_cutoff = iter->second;
-          for (int i = 0; i < ml.nsample; i++) {
-            if (ml.Counts[i][filter_name] + ml.counts[i][filter_name] >=
-                min_cutoff) {
-              filters_result = true;
-              break;
-            }
-          }
-          are_passed = are_passed && filters_result;
-        }
-        for (auto iter = all_cutoffs.begin(); iter != all_cutoffs.end();
-             ++iter) {
-          bool filters_result = true;
-          string filter_name = iter->first;
-          int min_cutoff = iter->second;
-          for (int i = 0; i < ml.nsample; i++) {
-            if (ml.Counts[i][filter_name] + ml.counts[i][filter_name] <
-                min_cutoff) {
-              filters_result = false;
-              break;
-            }
-          }
-          are_passed = are_passed && filters_result;
-        }
-        if (are_passed) {
-          ml.print_counter(cout, stat_indel, stat_ends, hide_strand, by_strand);
-        }
+        out << head << zero_old << counts << '\n';
+      }
+      if (!opt.index_path.empty()) {
+        index.add(with_old ? old_chr : b->chr, with_old ? old_pos : b->pos,
+                  offset);
+      }
+    };
+    auto add = [&](bool with_old, const site_view *b) {
+      if (copy_old) {
+        copy(with_old, b);
+      } else {
+        emit(with_old ? old : nullptr, b);
+      }
+    };
+
+    next_old();
+    pair<int, int> new_key(-1, 0);
+    parser merger(opt.read_opt, [&](const site_view &s) {
+      if (s.samples.size() != nnew) {
+        throw runtime_error("Number of samples differs at " + string(s.chr) +
+                            ":" + to_string(s.pos));
       }
+      auto k = key(s.chr, s.pos);
+      if (k <= new_key) {
+        throw runtime_error("Input is not sorted at " + string(s.chr) + ":" +
+                            to_string(s.pos));
+      }
+      new_key = k;
+      while (has_old && old_key < k) {
+        add(true, nullptr);
+        next_old();
+      }
+      if (has_old && old_key == k) {
+        add(true, &s);
+        next_old();
+      } else {
+        add(false, &s);
+      }
+    });
+    merger.feed(first.data(), first.size());
+    while ((n = fread(buf.data(), 1, buf.size(), stdin)) > 0) {
+      merger.feed(buf.data(), n);
+    }
+    merger.finish();
+    while (has_old) {
+      add(true, nullptr);
+      next_old();
+    }
+    if (records && records->inexact() > 0) {
+      cerr << "Warning: " << records->inexact() << " sites of " << args[0]
+           << " have more reads than counted bases (eg: bases equal to the "
+              "ref letter), their mismatches may differ from a single run. "
+              "Merge a site store for exact counts."
+           << endl;
+    }
+    if (store) {
+      store.reset();
+      fclose(store_fp);
+    }
+    if (old_fp != nullptr) {
+      fclose(old_fp);
+    }
+  } catch (const std::runtime_error &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  out.flush();
+  if (!opt.index_path.empty()) {
+    try {
+      index.save(opt.index_path, obuf.bytes());
+    } catch (const std::runtime_error &e) {
+      cerr << e.what() << endl;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1 && !strcmp(argv[1], "query")) {
+    return query_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && !strcmp(argv[1], "run")) {
+    return run_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && !strcmp(argv[1], "merge")) {
+    return merge_main(argc - 1, argv + 1);
+  }
+  cpup_options opt;
+  vector<string> args;
+  int ret = parse_options(argc, argv, opt, args);
+  if (ret >= 0) {
+    return ret;
+  }
+  const int checkpoint_every = 1 << 20;
+
+  // resume from checkpoint
+  checkpoint ck;
+  bool resume = false;
+  int out_fd = -1;
+  position_index index;
+  bool use_index = !opt.index_path.empty();
+  try {
+    if (!opt.checkpoint_path.empty()) {
+      resume = ck.load(opt.checkpoint_path);
+    }
+    out_fd = open_output(opt.output_path, !resume);
+    if (resume) {
+      // drop output written after the checkpoint
+      if (lseek(out_fd, 0, SEEK_END) < (off_t)ck.out_offset ||
+          ftruncate(out_fd, ck.out_offset) != 0 ||
+          lseek(out_fd, ck.out_offset, SEEK_SET) < 0) {
+        throw runtime_error("Output is shorter than checkpoint: " +
+                            opt.output_path);
+      }
+      if (use_index) {
+        reindex_output(opt.output_path, ck.out_offset, index);
+      }
+      skip_input(ck);
+    }
+  } catch (const std::runtime_error &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+
+  counting_buf obuf(out_fd, ck.out_offset);
+  ostream out(&obuf);
+  formatter fmt(opt);
+  uint64_t in_start = ck.in_offset;
+  int nline = 0;
+  checkpoint last;
+
+  // with --two-pass, sites are spilled to the store and stats on pass one
+  FILE *store_fp = nullptr;
+  unique_ptr<store_writer> store;
+  site_stats stats;
+  if (opt.two_pass) {
+    store_fp = opt.store_path.empty() ? tmpfile()
+                                      : fopen(opt.store_path.c_str(), "w+b");
+    if (store_fp == nullptr) {
+      cerr << "Can not open site store: " << opt.store_path << endl;
+      return 1;
+    }
+    store.reset(new store_writer(store_fp, opt.read_opt));
+  }
+
+  // record progress after the line
+  auto save_checkpoint = [&](const checkpoint &c) {
+    out.flush();
+    if (fsync(out_fd) != 0) {
+      throw io_error("Can not sync output file: " + opt.output_path);
+    }
+    c.save(opt.checkpoint_path);
+  };
+
+  // parse and print each line
+  parser p(opt.read_opt, [&](const site_view &site) {
+    if (store) {
+      store->add(site);
+      stats.add(site);
+      return;
+    }
+    uint64_t offset = obuf.bytes();
+    if (fmt.print_site(site, out) && use_index) {
+      index.add(site.chr, site.pos, offset);
+    }
+    if (!opt.checkpoint_path.empty()) {
+      last.chr.assign(site.chr);
+      last.pos = site.pos;
+      last.out_offset = obuf.bytes();
+      last.in_offset = in_start + p.line_end();
+      if (++nline % checkpoint_every == 0) {
+        save_checkpoint(last);
+      }
+    }
+  });
+  set_masks(p, opt);
+
+  // the first line gives the header
+  vector<char> buf(1 << 20);
+  string first = read_first_line(buf);
+  size_t n;
+
+  // print header
+  if (!opt.hide_header && !resume) {
+    string_view line(first);
+    line = line.substr(0, line.find('\n'));
+    try {
+      fmt.print_header(p.parse(line), out);
     } catch (const std::runtime_error &e) {
       cerr << e.what() << endl;
       cerr << "\nError parsing line " << line;
-      break;
     }
-    getline(cin, line);
+  }
+
+  try {
+    p.feed(first.data(), first.size());
+    while ((n = fread(buf.data(), 1, buf.size(), stdin)) > 0) {
+      p.feed(buf.data(), n);
+    }
+    p.finish();
+    if (nline > 0 && nline % checkpoint_every != 0) {
+      save_checkpoint(last);
+    }
+    if (store) {
+      store->flush();
+      second_pass(store_fp, stats, opt, out, [&]() { return obuf.bytes(); },
+                  use_index ? &index : nullptr);
+    }
+  } catch (const io_error &e) {
+    cerr << e.what() << endl;
+    return 1;
+  } catch (const std::runtime_error &e) {
+    cerr << e.what() << endl;
+    cerr << "\nError parsing line " << p.line();
+  }
+
+  fmt.finish(out);
+  out.flush();
+  if (use_index) {
+    try {
+      index.save(opt.index_path, obuf.bytes());
+    } catch (const std::runtime_error &e) {
+      cerr << e.what() << endl;
+      return 1;
+    }
   }
 }
@@ -0,0 +1,1368 @@
+/*
+ * libcpup.cpp
+ * Copyright (C) 2021 Ye Chang <yech1990@gmail.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "libcpup.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace cpup {
+
+static const unsigned char basemap[256] = {
+    0,   1,   2,   3,   4,   5,   6,   7,   8,   9,   10,  11,  12,  13,  14,
+    15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,  28,  29,
+    30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,  41,  42,  43,  44,
+    45,  46,  47,  48,  49,  50,  51,  52,  53,  54,  55,  56,  57,  58,  59,
+    60,  61,  62,  63,  64,  'T', 'V', 'G', 'H', 'E', 'F', 'C', 'D', 'I', 'J',
+    'M', 'L', 'K', 'N', 'O', 'P', 'Q', 'Y', 'S', 'A', 'A', 'B', 'W', 'X', 'R',
+    'Z', 91,  92,  93,  94,  95,  96,  't', 'v', 'g', 'h', 'e', 'f', 'c', 'd',
+    'i', 'j', 'm', 'l', 'k', 'n', 'o', 'p', 'q', 'y', 's', 'a', 'a', 'b', 'w',
+    'x', 'r', 'z', 123, 124, 125, 126, 127, 128, 129, 130, 131, 132, 133, 134,
+    135, 136, 137, 138, 139, 140, 141, 142, 143, 144, 145, 146, 147, 148, 149,
+    150, 151, 152, 153, 154, 155, 156, 157, 158, 159, 160, 161, 162, 163, 164,
+    165, 166, 167, 168, 169, 170, 171, 172, 173, 174, 175, 176, 177, 178, 179,
+    180, 181, 182, 183, 184, 185, 186, 187, 188, 189, 190, 191, 192, 193, 194,
+    195, 196, 197, 198, 199, 200, 201, 202, 203, 204, 205, 206, 207, 208, 209,
+    210, 211, 212, 213, 214, 215, 216, 217, 218, 219, 220, 221, 222, 223, 224,
+    225, 226, 227, 228, 229, 230, 231, 232, 233, 234, 235, 236, 237, 238, 239,
+    240, 241, 242, 243, 244, 245, 246, 247, 248, 249, 250, 251, 252, 253, 254,
+    255};
+
+// global variables
+static const vector<string> names = {"a",    "c",   "g",      "t",     "n",
+                                     "skip", "gap", "insert", "delete"};
+static const vector<string> names_upper = {
+    "A", "C", "G", "T", "N", "Skip", "Gap", "Insert", "Delete"};
+// field of names
+static const int name_fields[] = {counter::a,    counter::c,   counter::g,
+                                  counter::t,    counter::n,   counter::skip,
+                                  counter::gap,  counter::insert, counter::del};
+
+const vector<int> mapq_bins = {0, 10, 20, 30, 40, 50, 60};
+const vector<int> bp_bins = {1, 6, 11, 21, 51};
+
+static const string count_sep = ",";
+static const string indel_sep = "|";
+static const string sample_sep = "\t";
+
+// Convert a number to a string, 0 if it is not a number
+static int to_int(string_view num) {
+  size_t i = 0;
+  while (i < num.size() && isspace((unsigned char)num[i])) {
+    i++;
+  }
+  bool negative = i < num.size() && num[i] == '-';
+  if (i < num.size() && (num[i] == '-' || num[i] == '+')) {
+    i++;
+  }
+  int v = 0;
+  for (; i < num.size() && num[i] >= '0' && num[i] <= '9'; i++) {
+    v = v * 10 + (num[i] - '0');
+  }
+  return negative ? -v : v;
+}
+
+// Bin index of a value in histogram with lower bounds of bins
+static inline int hist_bin(const vector<int> &bins, int v) {
+  int k = bins.size() - 1;
+  while (k > 0 && v < bins[k]) {
+    k--;
+  }
+  return k;
+}
+
+int counter::index(const string &name) {
+  static const map<string, int> fields = {
+      {"coverage", coverage}, {"ref", ref},     {"mut", mut},
+      {"a", a},               {"c", c},         {"g", g},
+      {"t", t},               {"n", n},         {"skip", skip},
+      {"gap", gap},           {"insert", insert}, {"delete", del},
+  };
+  auto iter = fields.find(name);
+  return iter == fields.end() ? -1 : iter->second;
+}
+
+int counter::get(const string &name) const {
+  int f = index(name);
+  return f < 0 ? 0 : v[f];
+}
+
+// Switch the counts for complement bases
+counter counter::complement() const {
+  counter m = *this;
+  swap(m.v[a], m.v[t]);
+  swap(m.v[c], m.v[g]);
+  return m;
+}
+
+parser::parser(const read_options &opt, site_callback callback)
+    : opt(opt), callback(std::move(callback)) {}
+
+void parser::feed(const char *data, size_t size) {
+  const char *p = data, *end = data + size;
+  while (p < end) {
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    if (eol == nullptr) {
+      carry.append(p, end - p);
+      break;
+    }
+    if (carry.empty()) {
+      // zero copy for lines inside the buffer
+      offset += eol - p + 1;
+      handle(string_view(p, eol - p), offset);
+    } else {
+      carry.append(p, eol - p);
+      offset += carry.size() + 1;
+      handle(carry, offset);
+      carry.clear();
+    }
+    p = eol + 1;
+  }
+}
+
+void parser::finish() {
+  if (!carry.empty()) {
+    // count as if there was a newline
+    offset += carry.size() + 1;
+    handle(carry, offset);
+    carry.clear();
+  }
+}
+
+void parser::handle(string_view line, uint64_t end) {
+  cur_line = line;
+  end_offset = end;
+  if (filter) {
+    size_t t1 = line.find('\t');
+    if (t1 != string_view::npos) {
+      size_t t2 = line.find('\t', t1 + 1);
+      if (!filter(line.substr(0, t1), to_int(line.substr(t1 + 1, t2 - t1 - 1)))) {
+        return;
+      }
+    }
+  }
+  parse(line);
+  if (callback) {
+    callback(site);
+  }
+}
+
+// Split the line into the required fields and parse
+const site_view &parser::parse(string_view line) {
+  cur_line = line;
+  site.chr = site.ref = "NA";
+  site.pos = 0;
+  site.plain = true;
+  motifs.clear();
+  motif_ranges.clear();
+  hists.clear();
+  size_t nhist = (opt.mapq_hist ? mapq_bins.size() : 0) +
+                 (opt.bp_hist ? bp_bins.size() : 0);
+
+  // next tab separated column, false when there are no more columns
+  size_t p = 0;
+  bool more = !line.empty();
+  auto next_col = [&](string_view &col) {
+    if (!more) {
+      col = string_view();
+      return false;
+    }
+    size_t tab = line.find('\t', p);
+    if (tab == string_view::npos) {
+      col = line.substr(p);
+      more = false;
+    } else {
+      col = line.substr(p, tab - p);
+      p = tab + 1;
+      more = p < line.size();
+    }
+    return true;
+  };
+
+  string_view col, bases, quals, mapqs, bps;
+  int ncol = 0;
+  size_t nsample = 0;
+  while (next_col(col)) {
+    if (ncol == 0) {
+      // get chrosome ID
+      site.chr = col;
+    } else if (ncol == 1) {
+      // get pos
+      site.pos = to_int(col);
+    } else if (ncol == 2) {
+      // get ref_base
+      site.ref = col;
+    } else {
+      if (samples.size() <= nsample) {
+        samples.resize(nsample + 1);
+      }
+      sample_counts &s = samples[nsample];
+      // get depth
+      s.depth = to_int(col);
+      // get bases
+      next_col(bases);
+      // get quals
+      next_col(quals);
+      // get optional MAPQ and BP columns
+      if (opt.has_mapq) {
+        next_col(mapqs);
+      }
+      if (opt.has_bp) {
+        next_col(bps);
+      }
+      hists.resize(hists.size() + nhist, 0);
+      site.plain &= parse_sample(bases, mapqs, bps,
+                                 site.ref.empty() ? '\0' : site.ref[0], s);
+      nsample++;
+    }
+    ncol++;
+  }
+
+  // point spans to the pools, which do not move any more
+  point_spans(site, samples, nsample, motifs, motif_ranges, hists,
+              opt.mapq_hist ? mapq_bins.size() : 0, nhist);
+  return site;
+}
+
+void point_spans(site_view &site, vector<sample_counts> &samples,
+                 size_t nsample, vector<motif_count> &motifs,
+                 const vector<pair<size_t, size_t>> &ranges, vector<int> &hists,
+                 size_t nmapq, size_t nhist) {
+  for (size_t i = 0; i < nsample; i++) {
+    sample_counts &s = samples[i];
+    span<motif_count> *lists[] = {&s.ins_fwd, &s.ins_rev, &s.del_fwd,
+                                  &s.del_rev};
+    for (int k = 0; k < 4; k++) {
+      const pair<size_t, size_t> &r = ranges[i * 4 + k];
+      lists[k]->first = motifs.data() + r.first;
+      lists[k]->last = motifs.data() + r.second;
+    }
+    s.mapq_hist.first = hists.data() + i * nhist;
+    s.mapq_hist.last = s.bp_hist.first = s.mapq_hist.first + nmapq;
+    s.bp_hist.last = hists.data() + (i + 1) * nhist;
+  }
+  site.samples.first = samples.data();
+  site.samples.last = samples.data() + nsample;
+}
+
+// Count a indel sequence, lists are kept sorted by sequence
+static void add_motif(vector<motif_count> &v, string_view seq) {
+  auto iter = lower_bound(
+      v.begin(), v.end(), seq,
+      [](const motif_count &m, string_view s) { return m.motif < s; });
+  if (iter != v.end() && iter->motif == seq) {
+    iter->count++;
+  } else {
+    v.insert(iter, motif_count{seq, 1});
+  }
+}
+
+// Set the appropriate count for ref nucleotide
+int ref_field(char ref) {
+  switch (ref) {
+  case 'A':
+  case 'a':
+    return counter::a;
+  case 'C':
+  case 'c':
+    return counter::c;
+  case 'G':
+  case 'g':
+    return counter::g;
+  case 'T':
+  case 't':
+    return counter::t;
+  case 'N':
+  case 'n':
+    return counter::n;
+  // TODO: Deal with -,R,Y,K,M,S,W etc
+  default:
+    return -1;
+  }
+}
+
+static void fix_ref_counts(counter &m, char ref_base) {
+  int f = ref_field(ref_base);
+  if (f >= 0) {
+    m[f] = m[counter::ref];
+  }
+}
+
+// Count the bases of a sample with only ref bases and read ends, return
+// false as soon as anything else is found
+static bool count_plain(string_view bases, sample_counts &s) {
+  int fwd = 0, rev = 0, starts = 0, ends = 0;
+  for (size_t i = 0; i < bases.size(); i++) {
+    switch (bases[i]) {
+    case '.':
+      fwd++;
+      break;
+    case ',':
+      rev++;
+      break;
+    case '^':
+      starts++;
+      i++; // MAPQ of the read
+      break;
+    case '$':
+      ends++;
+      break;
+    default:
+      return false;
+    }
+  }
+  s.fwd[counter::ref] = s.fwd[counter::coverage] = fwd;
+  s.rev[counter::ref] = s.rev[counter::coverage] = rev;
+  s.sstat = starts;
+  s.estat = ends;
+  return true;
+}
+
+// Parse the pileup string, return if it has only ref bases (or none)
+bool parser::parse_sample(string_view bases, string_view mapqs,
+                          string_view bps, char ref, sample_counts &s) {
+  // forward strand
+  counter &M = s.fwd;
+  // reverse strand
+  counter &m = s.rev;
+  M = counter();
+  m = counter();
+  s.sstat = 0;
+  s.estat = 0;
+  int *mapq_hist = hists.data() + hists.size() -
+                   (opt.mapq_hist ? mapq_bins.size() : 0) -
+                   (opt.bp_hist ? bp_bins.size() : 0);
+  int *bp_hist = mapq_hist + (opt.mapq_hist ? mapq_bins.size() : 0);
+  for (auto &v : scratch) {
+    v.clear();
+  }
+
+  bool track_reads = (opt.mapq_hist && opt.has_mapq) || opt.has_bp;
+  bool plain = true;
+  // check if site is a empty (depth == 0), then the fast path of only ref
+  // bases, when nothing is collected per read
+  bool fast = bases == "*" ||
+              (!track_reads && !opt.mapq_hist && count_plain(bases, s));
+  if (!fast) {
+    // index of read at the current base, in the MAPQ and BP columns
+    size_t nread = 0, ntrim = 0;
+    size_t bp_pos = 0;
+    // the base of the current read is trimmed, so are its indel and `$'
+    bool trimmed = false;
+    // MAPQ of a `^' waiting for its base, as it is not counted if trimmed
+    int start_mapq = -1;
+    int len = bases.size();
+    // out of range reads as '\0', like std::string
+    auto at = [&](int i) { return i < len ? bases[i] : '\0'; };
+    auto count_start = [&](int q) {
+      s.sstat += 1;
+      // without MAPQ column, only MAPQ of reads starting here is known
+      if (opt.mapq_hist && !opt.has_mapq) {
+        mapq_hist[hist_bin(mapq_bins, q - 33)]++;
+      }
+    };
+    for (int i = 0; i < len; i++) {
+      char base = bases[i];
+      plain = plain && (base == '.' || base == ',' || base == '^' || base == '$');
+      if (track_reads && strchr(".,ACGTNacgtn<>*#", base) != nullptr) {
+        int mapq = -1, bp = -1;
+        if (opt.has_mapq) {
+          if (nread >= mapqs.size()) {
+            throw runtime_error("MAPQ column does not match bases: " +
+                                string(mapqs));
+          }
+          mapq = mapqs[nread] - 33;
+        }
+        if (opt.has_bp) {
+          size_t comma = bps.find(',', bp_pos);
+          string_view num = bps.substr(
+              min(bp_pos, bps.size()),
+              comma == string_view::npos ? string_view::npos : comma - bp_pos);
+          if (num.empty() || !isdigit((unsigned char)num[0])) {
+            throw runtime_error("BP column does not match bases: " +
+                                string(bps));
+          }
+          bp = to_int(num);
+          bp_pos = comma == string_view::npos ? bps.size() : comma + 1;
+        }
+        nread++;
+        trimmed = bp >= 0 && bp <= opt.trim_bp;
+        if (start_mapq >= 0 && !trimmed) {
+          count_start(start_mapq);
+        }
+        start_mapq = -1;
+        if (trimmed) {
+          ntrim++;
+          continue;
+        }
+        // only count aligned bases, not skips and gaps
+        if (strchr("<>*#", base) == nullptr) {
+          if (opt.mapq_hist && mapq >= 0) {
+            mapq_hist[hist_bin(mapq_bins, mapq)]++;
+          }
+          if (opt.bp_hist) {
+            bp_hist[hist_bin(bp_bins, bp)]++;
+          }
+        }
+      }
+      int indelsize_start, indelsize_int;
+      string_view indelseq;
+      switch (base) {
+      // Match to reference
+      case '.':
+        M[counter::ref] += 1;
+        break;
+      case ',':
+        m[counter::ref] += 1;
+        break;
+      case 'A':
+        M[counter::a] += 1;
+        break;
+      case 'a':
+        m[counter::a] += 1;
+        break;
+      case 'C':
+        M[counter::c] += 1;
+        break;
+      case 'c':
+        m[counter::c] += 1;
+        break;
+      case 'G':
+        M[counter::g] += 1;
+        break;
+      case 'g':
+        m[counter::g] += 1;
+        break;
+      case 'T':
+        M[counter::t] += 1;
+        break;
+      case 't':
+        m[counter::t] += 1;
+        break;
+      case 'N':
+        M[counter::n] += 1;
+        break;
+      case 'n':
+        m[counter::n] += 1;
+        break;
+      // Reference skips
+      case '>':
+        M[counter::skip] += 1;
+        break;
+      case '<':
+        m[counter::skip] += 1;
+        break;
+      // This base is a gap (--reverse-del suport)
+      // similar with Deletecount and deletecount, but with some difference
+      case '*':
+        M[counter::gap] += 1;
+        break;
+      case '#':
+        m[counter::gap] += 1;
+        break;
+      // Insertion and deletion
+      case '+':
+      case '-':
+        i++;
+        indelsize_start = i;
+        while (at(i) >= '0' && at(i) <= '9') {
+          i = i + 1;
+        }
+        indelsize_int = to_int(bases.substr(
+            min(indelsize_start, len), i - min(indelsize_start, len)));
+        indelseq = bases.substr(min(i, len), indelsize_int);
+        if (trimmed) {
+          // skip the sequence only
+        } else if (isupper(at(i))) {
+          M[base == '+' ? counter::insert : counter::del] += 1;
+          add_motif(scratch[base == '+' ? 0 : 2], indelseq);
+        } else {
+          m[base == '+' ? counter::insert : counter::del] += 1;
+          add_motif(scratch[base == '+' ? 1 : 3], indelseq);
+        }
+        i += indelsize_int - 1;
+        break;
+      // Beginning of read segment, Skip i and i + 1
+      // The ASCII of the character following `^' minus 33 gives the mapping
+      // quality.
+      case '^':
+        i = i + 1;
+        // with BP column, wait for the base to know if it is trimmed
+        if (opt.has_bp) {
+          start_mapq = (unsigned char)at(i);
+        } else {
+          count_start((unsigned char)at(i));
+        }
+        break;
+      // End of read segment, Skip i
+      // A symbol `$' marks the end of a read segment.
+      case '$':
+        if (!trimmed) {
+          s.estat += 1;
+        }
+        break;
+      default:
+        string err = "Unknown ref base: ";
+        err += base;
+        throw runtime_error(err);
+      }
+    }
+
+    M[counter::mut] = M[counter::a] + M[counter::c] + M[counter::g] +
+                      M[counter::t];
+    M[counter::coverage] = M[counter::ref] + M[counter::mut];
+
+    m[counter::mut] = m[counter::a] + m[counter::c] + m[counter::g] +
+                      m[counter::t];
+    m[counter::coverage] = m[counter::ref] + m[counter::mut];
+    // trimmed bases are not in depth either
+    s.depth = max<int>(s.depth - ntrim, 0);
+  }
+  fix_ref_counts(M, ref);
+  fix_ref_counts(m, ref);
+
+  for (auto &v : scratch) {
+    motif_ranges.emplace_back(motifs.size(), motifs.size() + v.size());
+    motifs.insert(motifs.end(), v.begin(), v.end());
+  }
+  return plain;
+}
+
+double scorer::lfact(int n) {
+  while ((int)log_fact.size() <= n) {
+    log_fact.push_back(log_fact.back() + log((double)log_fact.size()));
+  }
+  return log_fact[n];
+}
+
+double scorer::log_hyper(int x, int r1, int r2, int c1) {
+  int n = r1 + r2;
+  return lfact(r1) - lfact(x) - lfact(r1 - x) + lfact(r2) - lfact(c1 - x) -
+         lfact(r2 - c1 + x) - lfact(n) + lfact(c1) + lfact(n - c1);
+}
+
+double scorer::binom(int k, int n, double p) {
+  if (k <= 0 || p >= 1) {
+    return 1;
+  }
+  if (k > n || p <= 0) {
+    return 0;
+  }
+  // terms of the pmf from the ratio of neighbours, stop when negligible
+  double odds = p / (1 - p);
+  double term = exp(lfact(n) - lfact(k) - lfact(n - k) + k * log(p) +
+                    (n - k) * log1p(-p));
+  double sum = 0;
+  if (k > n * p) {
+    for (int j = k; j <= n && term > sum * 1e-17; j++) {
+      sum += term;
+      term *= (double)(n - j) / (j + 1) * odds;
+    }
+    return min(sum, 1.0);
+  }
+  // upper tail is large, sum the lower one instead
+  for (int j = k; j > 0 && (j == k || term > sum * 1e-17);) {
+    term *= (double)j / (n - j + 1) / odds;
+    j--;
+    sum += term;
+  }
+  return max(1 - sum, 0.0);
+}
+
+double scorer::fisher(int a, int b, int c, int d) {
+  int r1 = a + b, r2 = c + d, c1 = a + c;
+  int lo = max(0, c1 - r2), hi = min(r1, c1);
+  if (lo == hi) {
+    return 1;
+  }
+  // tables as likely as observed or less, with the relative tolerance of R
+  double limit = log_hyper(a, r1, r2, c1) + 1e-7;
+  auto rare = [&](int x) { return log_hyper(x, r1, r2, c1) <= limit; };
+  // sum of a tail, going away from the mode from x
+  auto tail = [&](int x, int step) {
+    double term = exp(log_hyper(x, r1, r2, c1)), sum = 0;
+    while (x >= lo && x <= hi && term > sum * 1e-17) {
+      sum += term;
+      if (step > 0) {
+        term *= (double)(r1 - x) * (c1 - x) / ((x + 1.0) * (r2 - c1 + x + 1.0));
+      } else {
+        term *= (double)x * (r2 - c1 + x) / ((r1 - x + 1.0) * (c1 - x + 1.0));
+      }
+      x += step;
+    }
+    return sum;
+  };
+  int mode = (int)((r1 + 1.0) * (c1 + 1.0) / (r1 + r2 + 2.0));
+  mode = min(max(mode, lo), hi);
+  // the other tail starts at the first rare table past the mode, found by
+  // bisection as the pmf is monotone there
+  double sum;
+  if (a <= mode) {
+    int l = max(a + 1, mode), h = hi + 1;
+    while (l < h) {
+      int m = (l + h) / 2;
+      rare(m) ? h = m : l = m + 1;
+    }
+    sum = tail(a, -1) + (l <= hi ? tail(l, 1) : 0);
+  } else {
+    int l = lo - 1, h = min(a - 1, mode);
+    while (l < h) {
+      int m = (l + h + 1) / 2;
+      rare(m) ? l = m : h = m - 1;
+    }
+    sum = tail(a, 1) + (l >= lo ? tail(l, -1) : 0);
+  }
+  return min(sum, 1.0);
+}
+
+formatter::formatter(const options &opt) : opt(opt) {
+  for (auto &name : opt.count_names) {
+    columns.push_back(counter::index(name));
+  }
+  for (auto &c : opt.any_cutoffs) {
+    any_cutoffs.emplace_back(counter::index(c.first), c.second);
+  }
+  for (auto &c : opt.all_cutoffs) {
+    all_cutoffs.emplace_back(counter::index(c.first), c.second);
+  }
+}
+
+void formatter::print_header(const site_view &site, ostream &out) {
+  const vector<string> &count_names = opt.count_names;
+  out << "chr" << sample_sep << "pos" << sample_sep << "ref_base";
+  if (opt.by_strand) {
+    out << sample_sep << "strand";
+  }
+  for (size_t i = 0; i < site.samples.size(); i++) {
+    if (count_names.size() == 0) {
+      out << sample_sep << "depth";
+    } else {
+      out << sample_sep;
+    }
+    if (!opt.hide_strand && !opt.by_strand) {
+      // output header of upper case
+      if (count_names.size() > 0) {
+        for (size_t j = 0; j < count_names.size(); j++) {
+          string col = count_names[j];
+          std::transform(col.begin(), col.begin() + 1, col.begin(),
+                         [](unsigned char c) { return ::toupper(c); });
+          if (j == 0) {
+            out << col;
+          } else {
+            out << count_sep << col;
+          }
+        }
+      } else {
+        for (size_t j = 0; j < names_upper.size(); j++) {
+          out << count_sep << names_upper[j];
+        }
+      }
+      if (opt.stat_indel) {
+        out << count_sep << "Istat";
+        out << count_sep << "Dstat";
+      }
+      out << count_sep;
+    }
+    // output header of lower case
+    if (count_names.size() > 0) {
+      for (size_t j = 0; j < count_names.size(); j++) {
+        if (j == 0) {
+          out << count_names[j];
+        } else {
+          out << count_sep << count_names[j];
+        }
+      }
+    } else {
+      for (size_t j = 0; j < names.size(); j++) {
+        out << count_sep << names[j];
+      }
+    }
+    if (opt.stat_indel) {
+      out << count_sep << "istat";
+      out << count_sep << "dstat";
+    }
+    if (opt.stat_ends) {
+      out << count_sep << "sstat";
+      out << count_sep << "estat";
+    }
+    if (opt.read_opt.mapq_hist) {
+      out << count_sep << "mapq";
+    }
+    if (opt.read_opt.bp_hist) {
+      out << count_sep << "readpos";
+    }
+    if (opt.score != no_score) {
+      out << count_sep << "pval";
+    }
+  }
+  out << '\n';
+}
+
+// Print the count columns, the first is not separated when selected by name
+void formatter::print_counts(const counter &m, bool first, ostream &out) {
+  if (columns.size() > 0) {
+    for (size_t j = 0; j < columns.size(); j++) {
+      if (!(j == 0 && first)) {
+        out << count_sep;
+      }
+      out << (columns[j] < 0 ? 0 : m[columns[j]]);
+    }
+  } else {
+    for (int f : name_fields) {
+      out << count_sep << m[f];
+    }
+  }
+}
+
+void formatter::print_pval(double p, ostream &out) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.3g", p);
+  out << count_sep << buf;
+}
+
+bool formatter::score_samples(const vector<counter> &counts,
+                              const vector<counter> *rev_counts,
+                              vector<double> &out) {
+  size_t nsample = counts.size();
+  auto total = [&](size_t i, int f) {
+    return counts[i][f] + (rev_counts ? (*rev_counts)[i][f] : 0);
+  };
+  if (opt.score == fisher_score && opt.control >= (int)nsample) {
+    throw runtime_error("Control sample " + to_string(opt.control + 1) +
+                        " is not in input");
+  }
+  out.resize(nsample);
+  bool any = opt.any_pval < 0, all = true;
+  for (size_t i = 0; i < nsample; i++) {
+    int mut = total(i, counter::mut), cov = total(i, counter::coverage);
+    if (opt.score == binom_score) {
+      double rate = i < opt.error_rates.size() ? opt.error_rates[i]
+                                               : opt.error_rates.back();
+      out[i] = scores.binom(mut, cov, rate);
+    } else {
+      int c_mut = total(opt.control, counter::mut);
+      int c_cov = total(opt.control, counter::coverage);
+      out[i] = scores.fisher(mut, cov - mut, c_mut, c_cov - c_mut);
+    }
+    // the control is not tested against itself
+    if (opt.score == fisher_score && (int)i == opt.control) {
+      continue;
+    }
+    any = any || out[i] <= opt.any_pval;
+    all = all && (opt.all_pval < 0 || out[i] <= opt.all_pval);
+  }
+  return any && all;
+}
+
+void formatter::print_motifs(span<motif_count> ids, ostream &out) {
+  out << count_sep;
+  for (size_t k = 0; k < ids.size(); k++) {
+    if (k > 0) {
+      out << indel_sep;
+    }
+    out << ids[k].motif << ':' << ids[k].count;
+  }
+}
+
+// Print indels of both strands, grouped by upper case sequence
+void formatter::print_merged(span<motif_count> upper, span<motif_count> lower,
+                             ostream &out) {
+  merged.clear();
+  for (auto ids : {upper, lower}) {
+    for (auto &m : ids) {
+      string motif(m.motif);
+      std::transform(motif.begin(), motif.end(), motif.begin(),
+                     [](unsigned char c) { return ::toupper(c); });
+      merged.emplace_back(motif, m.count);
+    }
+  }
+  sort(merged.begin(), merged.end());
+  out << count_sep;
+  for (size_t k = 0; k < merged.size();) {
+    size_t l = k;
+    int count = 0;
+    for (; l < merged.size() && merged[l].first == merged[k].first; l++) {
+      count += merged[l].second;
+    }
+    if (k > 0) {
+      out << indel_sep;
+    }
+    out << merged[k].first << ':' << count;
+    k = l;
+  }
+}
+
+// Print a line of one strand, for output by strand
+void formatter::print_strand(const site_view &site, char strand,
+                             ostream &out) {
+  bool forward = strand == '+';
+  out << site.chr << sample_sep << site.pos << sample_sep;
+  if (forward) {
+    out << ref;
+  } else {
+    out << basemap[(unsigned char)(ref.empty() ? '\0' : ref[0])];
+  }
+  out << sample_sep << strand;
+  for (size_t i = 0; i < site.samples.size(); i++) {
+    const sample_counts &s = site.samples[i];
+    counter m = forward ? fwd[i] : rev[i].complement();
+    // show depth
+    if (columns.size() == 0) {
+      out << sample_sep << m[counter::coverage];
+    } else {
+      out << sample_sep;
+    }
+    print_counts(m, true, out);
+    // indel stat
+    if (opt.stat_indel) {
+      print_motifs(forward ? s.ins_fwd : s.ins_rev, out);
+      print_motifs(forward ? s.del_fwd : s.del_rev, out);
+    }
+    if (opt.score != no_score) {
+      print_pval(forward ? pvals[i] : pvals_rev[i], out);
+    }
+  }
+  out << '\n';
+}
+
+void formatter::print_unstranded(const site_view &site, ostream &out) {
+  out << site.chr << sample_sep << site.pos << sample_sep << ref;
+  for (size_t i = 0; i < site.samples.size(); i++) {
+    const sample_counts &s = site.samples[i];
+    // show depth
+    if (columns.size() == 0) {
+      out << sample_sep << s.depth;
+    } else {
+      out << sample_sep;
+    }
+    counter sum;
+    for (int f = 0; f < counter::nfield; f++) {
+      sum[f] = fwd[i][f] + rev[i][f];
+    }
+    print_counts(sum, true, out);
+    // indel stat
+    if (opt.stat_indel) {
+      print_merged(s.ins_fwd, s.ins_rev, out);
+      print_merged(s.del_fwd, s.del_rev, out);
+    }
+    // ends stat
+    if (opt.stat_ends) {
+      out << count_sep << s.sstat;
+      out << count_sep << s.estat;
+    }
+    // read QC histograms
+    for (auto hist : {s.mapq_hist, s.bp_hist}) {
+      for (size_t k = 0; k < hist.size(); k++) {
+        out << (k == 0 ? count_sep : indel_sep) << hist[k];
+      }
+    }
+    if (opt.score != no_score) {
+      print_pval(pvals[i], out);
+    }
+  }
+  out << '\n';
+}
+
+void formatter::print_stranded(const site_view &site, ostream &out) {
+  out << site.chr << sample_sep << site.pos << sample_sep << ref;
+  for (size_t i = 0; i < site.samples.size(); i++) {
+    const sample_counts &s = site.samples[i];
+    // show depth
+    if (columns.size() == 0) {
+      out << sample_sep << s.depth;
+    } else {
+      out << sample_sep;
+    }
+    // show forward strand
+    print_counts(fwd[i], true, out);
+    if (opt.stat_indel) {
+      print_motifs(s.ins_fwd, out);
+      print_motifs(s.del_fwd, out);
+    }
+    // show reverse strand
+    print_counts(rev[i], false, out);
+    if (opt.stat_indel) {
+      print_motifs(s.ins_rev, out);
+      print_motifs(s.del_rev, out);
+    }
+    if (opt.score != no_score) {
+      print_pval(pvals[i], out);
+    }
+  }
+  out << '\n';
+}
+
+bool formatter::collapse(const site_view &site, ostream &out) {
+  if (!opt.rle) {
+    return false;
+  }
+  size_t nsample = site.samples.size();
+  if (!site.plain) {
+    finish(out);
+    return false;
+  }
+  // extend the run over the next position of the same contig
+  if (in_run && site.pos == run_end + 1 && site.chr == run_chr &&
+      nsample == run_depths.size()) {
+    run_end = site.pos;
+    for (size_t i = 0; i < nsample; i++) {
+      int depth = site.samples[i].depth;
+      run_depths[i].first = min(run_depths[i].first, depth);
+      run_depths[i].second = max(run_depths[i].second, depth);
+    }
+    return true;
+  }
+  finish(out);
+  run_chr.assign(site.chr);
+  run_start = run_end = site.pos;
+  run_depths.resize(nsample);
+  for (size_t i = 0; i < nsample; i++) {
+    run_depths[i].first = run_depths[i].second = site.samples[i].depth;
+  }
+  in_run = true;
+  return true;
+}
+
+void formatter::finish(ostream &out) {
+  if (!in_run) {
+    return;
+  }
+  out << run_chr << sample_sep << run_start << sample_sep << run_end;
+  for (auto &d : run_depths) {
+    out << sample_sep << d.first << '-' << d.second;
+  }
+  out << '\n';
+  in_run = false;
+}
+
+bool formatter::print_site(const site_view &site, ostream &out) {
+  size_t nsample = site.samples.size();
+  // the last max depth is for the rest of samples
+  for (size_t i = 0; i < nsample && !opt.max_depths.empty(); i++) {
+    size_t k = min(i, opt.max_depths.size() - 1);
+    if (site.samples[i].depth > opt.max_depths[k]) {
+      return false;
+    }
+  }
+  ref.assign(site.ref);
+  if (opt.to_upper) {
+    std::transform(ref.begin(), ref.end(), ref.begin(),
+                   [](unsigned char c) { return ::toupper(c); });
+  }
+  fwd.resize(nsample);
+  rev.resize(nsample);
+  for (size_t i = 0; i < nsample; i++) {
+    fwd[i] = site.samples[i].fwd;
+    rev[i] = site.samples[i].rev;
+  }
+  if (opt.reverse_strand) {
+    std::transform(ref.begin(), ref.end(), ref.begin(),
+                   [](unsigned char c) { return basemap[c]; });
+    for (size_t i = 0; i < nsample; i++) {
+      fwd[i] = fwd[i].complement();
+      rev[i] = rev[i].complement();
+    }
+  }
+  auto value = [](const counter &m, int f) { return f < 0 ? 0 : m[f]; };
+
+  if (opt.by_strand) {
+    bool is_passed[2] = {true, true};
+    for (auto &cutoff : any_cutoffs) {
+      bool filters_result_fwd = false;
+      bool filters_result_rev = false;
+      for (size_t i = 0; i < nsample; i++) {
+        filters_result_fwd |= value(fwd[i], cutoff.first) >= cutoff.second;
+        filters_result_rev |= value(rev[i], cutoff.first) >= cutoff.second;
+      }
+      is_passed[0] = is_passed[0] && filters_result_fwd;
+      is_passed[1] = is_passed[1] && filters_result_rev;
+    }
+    for (auto &cutoff : all_cutoffs) {
+      bool filters_result_fwd = true;
+      bool filters_result_rev = true;
+      for (size_t i = 0; i < nsample; i++) {
+        filters_result_fwd &= value(fwd[i], cutoff.first) >= cutoff.second;
+        filters_result_rev &= value(rev[i], cutoff.first) >= cutoff.second;
+      }
+      is_passed[0] = is_passed[0] && filters_result_fwd;
+      is_passed[1] = is_passed[1] && filters_result_rev;
+    }
+    // drop minor strand
+    // test each strand of passed sites only
+    if (opt.score != no_score) {
+      if (is_passed[0]) {
+        is_passed[0] = score_samples(fwd, nullptr, pvals);
+      }
+      if (is_passed[1]) {
+        is_passed[1] = score_samples(rev, nullptr, pvals_rev);
+      }
+    }
+    if (opt.major_strand) {
+      int coverage_fwd = 0;
+      int coverage_rev = 0;
+      for (size_t i = 0; i < nsample; i++) {
+        coverage_fwd += fwd[i][counter::coverage];
+        coverage_rev += rev[i][counter::coverage];
+      }
+      if (coverage_fwd > coverage_rev) {
+        is_passed[1] = false;
+      } else if (coverage_fwd < coverage_rev) {
+        is_passed[0] = false;
+      }
+    }
+    if ((is_passed[0] || is_passed[1]) && collapse(site, out)) {
+      return false;
+    }
+    if (is_passed[0]) {
+      print_strand(site, '+', out);
+    }
+    if (is_passed[1]) {
+      print_strand(site, '-', out);
+    }
+    return is_passed[0] || is_passed[1];
+  }
+
+  bool are_passed = true;
+  for (auto &cutoff : any_cutoffs) {
+    bool filters_result = false;
+    for (size_t i = 0; i < nsample; i++) {
+      filters_result |= value(fwd[i], cutoff.first) +
+                            value(rev[i], cutoff.first) >=
+                        cutoff.second;
+    }
+    are_passed = are_passed && filters_result;
+  }
+  for (auto &cutoff : all_cutoffs) {
+    bool filters_result = true;
+    for (size_t i = 0; i < nsample; i++) {
+      filters_result &= value(fwd[i], cutoff.first) +
+                            value(rev[i], cutoff.first) >=
+                        cutoff.second;
+    }
+    are_passed = are_passed && filters_result;
+  }
+  if (!are_passed) {
+    return false;
+  }
+  if (opt.score != no_score && !score_samples(fwd, &rev, pvals)) {
+    return false;
+  }
+  if (collapse(site, out)) {
+    return false;
+  }
+  if (opt.hide_strand) {
+    print_unstranded(site, out);
+  } else {
+    print_stranded(site, out);
+  }
+  return true;
+}
+
+record_parser::record_parser(const options &opt) : opt(opt) {}
+
+void record_parser::parse_motifs(string_view text) {
+  size_t first = motifs.size();
+  for (size_t p = 0; p < text.size();) {
+    size_t end = min(text.find(indel_sep, p), text.size());
+    string_view item = text.substr(p, end - p);
+    size_t colon = item.rfind(':');
+    if (colon == string_view::npos) {
+      throw runtime_error("Invalid indel count: " + string(item));
+    }
+    motifs.push_back(motif_count{item.substr(0, colon),
+                                 to_int(item.substr(colon + 1))});
+    p = end + 1;
+  }
+  motif_ranges.emplace_back(first, motifs.size());
+}
+
+void record_parser::parse_hist(string_view text, size_t size) {
+  size_t n = 0;
+  for (size_t p = 0; p <= text.size(); n++) {
+    size_t end = min(text.find(indel_sep, p), text.size());
+    hists.push_back(to_int(text.substr(p, end - p)));
+    p = end + 1;
+  }
+  if (n != size) {
+    throw runtime_error("Invalid histogram: " + string(text));
+  }
+}
+
+const site_view &record_parser::parse(string_view line) {
+  // split columns, then counts of each sample
+  cols.clear();
+  for (size_t p = 0; p <= line.size();) {
+    size_t end = min(line.find(sample_sep, p), line.size());
+    cols.push_back(line.substr(p, end - p));
+    p = end + 1;
+  }
+  if (cols.size() < 3) {
+    throw runtime_error("Invalid record: " + string(line));
+  }
+  site.chr = cols[0];
+  site.pos = to_int(cols[1]);
+  ref.assign(cols[2]);
+  if (opt.reverse_strand) {
+    std::transform(ref.begin(), ref.end(), ref.begin(),
+                   [](unsigned char c) { return basemap[c]; });
+  }
+  site.ref = ref;
+  int rf = ref_field(ref.empty() ? '\0' : ref[0]);
+
+  size_t nsample = cols.size() - 3;
+  bool inexact_site = false;
+  samples.assign(nsample, sample_counts());
+  motifs.clear();
+  motif_ranges.clear();
+  hists.clear();
+  size_t nmapq = opt.read_opt.mapq_hist ? mapq_bins.size() : 0;
+  size_t nhist = nmapq + (opt.read_opt.bp_hist ? bp_bins.size() : 0);
+  for (size_t i = 0; i < nsample; i++) {
+    string_view col = cols[3 + i];
+    values.clear();
+    for (size_t p = 0; p <= col.size();) {
+      size_t end = min(col.find(count_sep, p), col.size());
+      values.push_back(col.substr(p, end - p));
+      p = end + 1;
+    }
+    size_t nstrand = opt.hide_strand ? 1 : 2;
+    size_t expected = 1 + nstrand * (names.size() + (opt.stat_indel ? 2 : 0));
+    if (opt.hide_strand) {
+      expected += (opt.stat_ends ? 2 : 0) + (nmapq > 0) + (nhist > nmapq);
+    }
+    expected += opt.score != no_score;
+    if (values.size() != expected) {
+      throw runtime_error("Invalid counts of sample " + to_string(i + 1) +
+                          ": " + string(col));
+    }
+    sample_counts &s = samples[i];
+    s.depth = to_int(values[0]);
+    int bases = 0;
+    size_t k = 1;
+    for (counter *m : {&s.fwd, &s.rev}) {
+      if (m == &s.rev && opt.hide_strand) {
+        break;
+      }
+      for (int f : name_fields) {
+        (*m)[f] = to_int(values[k++]);
+        bases += f == counter::insert || f == counter::del ? 0 : (*m)[f];
+      }
+      if (opt.reverse_strand) {
+        *m = m->complement();
+      }
+      // mismatches are the bases but ref base, which has the count of ref
+      for (int f : {counter::a, counter::c, counter::g, counter::t}) {
+        (*m)[counter::mut] += f == rf ? 0 : (*m)[f];
+      }
+      (*m)[counter::ref] = rf < 0 ? 0 : (*m)[rf];
+      (*m)[counter::coverage] = (*m)[counter::ref] + (*m)[counter::mut];
+      if (opt.stat_indel) {
+        parse_motifs(values[k++]);
+        parse_motifs(values[k++]);
+      } else {
+        motif_ranges.emplace_back(motifs.size(), motifs.size());
+        motif_ranges.emplace_back(motifs.size(), motifs.size());
+      }
+    }
+    if (opt.hide_strand) {
+      // merged indels are all on forward strand
+      motif_ranges.emplace_back(motifs.size(), motifs.size());
+      motif_ranges.emplace_back(motifs.size(), motifs.size());
+      if (opt.stat_ends) {
+        s.sstat = to_int(values[k++]);
+        s.estat = to_int(values[k++]);
+      }
+      if (nmapq > 0) {
+        parse_hist(values[k++], nmapq);
+      }
+      if (nhist > nmapq) {
+        parse_hist(values[k++], nhist - nmapq);
+      }
+    }
+    // ranges were read as ins and del of fwd, then of rev
+    swap(motif_ranges[i * 4 + 1], motif_ranges[i * 4 + 2]);
+    inexact_site = inexact_site || s.depth > bases;
+  }
+  ninexact += inexact_site;
+  // spans point into the pools once they are complete
+  point_spans(site, samples, nsample, motifs, motif_ranges, hists, nmapq,
+              nhist);
+  return site;
+}
+
+void site_mask::load(const string &path) {
+  ifstream in(path);
+  if (!in) {
+    throw runtime_error("Can not open mask file: " + path);
+  }
+  bool is_vcf = path.size() > 4 && (path.substr(path.size() - 4) == ".vcf");
+  loaded = true;
+  // only contigs of this file are built again
+  map<string, vector<pair<int, int>>> added;
+  string line;
+  while (getline(in, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    if (line[0] == '#') {
+      if (line.compare(0, 16, "##fileformat=VCF") == 0) {
+        is_vcf = true;
+      }
+      continue;
+    }
+    if (line.compare(0, 5, "track") == 0 ||
+        line.compare(0, 7, "browser") == 0) {
+      continue;
+    }
+    // columns might be separated by spaces
+    stringstream ss(line);
+    string chr, id, ref;
+    int start, end;
+    if (is_vcf) {
+      // VCF is 1-based, the record covers the REF allele
+      if (!(ss >> chr >> start >> id >> ref)) {
+        throw runtime_error("Invalid mask line: " + line);
+      }
+      start -= 1;
+      end = start + max<int>(ref.size(), 1);
+    } else if (!(ss >> chr >> start >> end)) {
+      throw runtime_error("Invalid mask line: " + line);
+    }
+    if (end > start) {
+      added[chr].emplace_back(start, end);
+    }
+  }
+  for (auto &a : added) {
+    contig_mask &c = contigs[a.first];
+    if (c.dense) {
+      // back to intervals, to merge with the new ones
+      for (int k = 0; k < c.end - c.start; k++) {
+        if ((c.bits[k >> 6] >> (k & 63)) & 1) {
+          if (!c.intervals.empty() &&
+              c.intervals.back().second == c.start + k) {
+            c.intervals.back().second++;
+          } else {
+            c.intervals.emplace_back(c.start + k, c.start + k + 1);
+          }
+        }
+      }
+      c.bits.clear();
+      c.dense = false;
+    }
+    c.intervals.insert(c.intervals.end(), a.second.begin(), a.second.end());
+    build(c);
+  }
+  cur_chr.clear();
+  cur = nullptr;
+}
+
+bool site_mask::contains(string_view chr, int pos) {
+  if (chr != cur_chr) {
+    cur_chr = chr;
+    auto iter = contigs.find(chr);
+    cur = iter == contigs.end() ? nullptr : &iter->second;
+    cursor = 0;
+    last_pos = -1;
+  }
+  if (cur == nullptr) {
+    return false;
+  }
+  int p = pos - 1;
+  if (cur->dense) {
+    if (p < cur->start || p >= cur->end) {
+      return false;
+    }
+    int k = p - cur->start;
+    return (cur->bits[k >> 6] >> (k & 63)) & 1;
+  }
+  const vector<pair<int, int>> &iv = cur->intervals;
+  if (p < last_pos) {
+    // unsorted input, relocate the cursor
+    cursor = upper_bound(iv.begin(), iv.end(), make_pair(p, INT32_MAX)) -
+             iv.begin();
+    cursor = cursor > 0 ? cursor - 1 : 0;
+  }
+  last_pos = p;
+  while (cursor < iv.size() && iv[cursor].second <= p) {
+    cursor++;
+  }
+  return cursor < iv.size() && iv[cursor].first <= p;
+}
+
+void merge_intervals(vector<pair<int, int>> &iv) {
+  sort(iv.begin(), iv.end());
+  size_t n = 0;
+  for (size_t i = 0; i < iv.size(); i++) {
+    if (n > 0 && iv[i].first <= iv[n - 1].second) {
+      iv[n - 1].second = max(iv[n - 1].second, iv[i].second);
+    } else {
+      iv[n++] = iv[i];
+    }
+  }
+  iv.resize(n);
+}
+
+void site_mask::build(contig_mask &c) {
+  vector<pair<int, int>> &iv = c.intervals;
+  merge_intervals(iv);
+  size_t n = iv.size();
+  if (iv.empty()) {
+    return;
+  }
+  c.start = iv.front().first;
+  c.end = iv.back().second;
+  // a bitmap is smaller than the interval list when intervals are dense
+  if ((int64_t)n * 64 > (int64_t)(c.end - c.start)) {
+    c.dense = true;
+    c.bits.assign((c.end - c.start + 63) / 64, 0);
+    for (auto &i : iv) {
+      for (int k = i.first - c.start; k < i.second - c.start; k++) {
+        c.bits[k >> 6] |= uint64_t(1) << (k & 63);
+      }
+    }
+    iv.clear();
+    iv.shrink_to_fit();
+  }
+}
+
+vector<string> split_string(const string &i_str, const string &i_delim) {
+  vector<string> result;
+
+  size_t found = i_str.find(i_delim);
+  size_t startIndex = 0;
+
+  while (found != string::npos) {
+    result.push_back(string(i_str.begin() + startIndex, i_str.begin() + found));
+    startIndex = found + i_delim.size();
+    found = i_str.find(i_delim, startIndex);
+  }
+  if (startIndex != i_str.size())
+    result.push_back(string(i_str.begin() + startIndex, i_str.end()));
+  return result;
+}
+
+// Get chr and pos of a mpileup line without parsing the sample columns
+bool split_site(string_view line, string &chr, int &pos) {
+  size_t t1 = line.find('\t');
+  if (t1 == string_view::npos) {
+    return false;
+  }
+  chr.assign(line.substr(0, t1));
+  size_t t2 = line.find('\t', t1 + 1);
+  pos = to_int(line.substr(t1 + 1, t2 == string_view::npos ? t2 : t2 - t1 - 1));
+  return true;
+}
+
+} // namespace cpup
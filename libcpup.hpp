@@ -0,0 +1,304 @@
+/*
+ * libcpup.hpp
+ * Copyright (C) 2021 Ye Chang <yech1990@gmail.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef LIBCPUP_HPP
+#define LIBCPUP_HPP
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace cpup {
+
+// Read-only view of a contiguous range
+template <typename T> struct span {
+  const T *first = nullptr, *last = nullptr;
+
+  const T *begin() const { return first; }
+  const T *end() const { return last; }
+  size_t size() const { return last - first; }
+  bool empty() const { return first == last; }
+  const T &operator[](size_t i) const { return first[i]; }
+};
+
+// Counts of one strand of a sample at a site
+struct counter {
+  enum field {
+    coverage,
+    ref,
+    mut,
+    a,
+    c,
+    g,
+    t,
+    n,
+    skip,
+    gap,
+    insert,
+    del,
+    nfield
+  };
+  int v[nfield] = {};
+
+  int &operator[](int f) { return v[f]; }
+  int operator[](int f) const { return v[f]; }
+  // value by column name, 0 for unknown names
+  int get(const std::string &name) const;
+  // field of a column name, -1 for unknown names
+  static int index(const std::string &name);
+  // counts for the complement bases
+  counter complement() const;
+};
+
+// Indel sequence and its count, the sequence points into the input line
+struct motif_count {
+  std::string_view motif;
+  int count;
+};
+
+// Counts of one sample at a site, forward strand in upper case names
+struct sample_counts {
+  int depth = 0;
+  counter fwd, rev;
+  span<motif_count> ins_fwd, ins_rev, del_fwd, del_rev;
+  int sstat = 0, estat = 0;
+  span<int> mapq_hist, bp_hist;
+};
+
+// A parsed mpileup line, valid until the next line is parsed
+struct site_view {
+  std::string_view chr;
+  int pos = 0;
+  std::string_view ref;
+  span<sample_counts> samples;
+  bool plain = false; // only ref bases (or none) in all samples
+};
+
+// Optional columns of the input and the read QC to collect from them
+struct read_options {
+  bool has_mapq = false; // samtools mpileup --output-MAPQ
+  bool has_bp = false;   // samtools mpileup --output-BP
+  bool mapq_hist = false;
+  bool bp_hist = false;
+  int trim_bp = 0;
+};
+
+// lower bounds of histogram bins for MAPQ and read position (1-based)
+extern const std::vector<int> mapq_bins;
+extern const std::vector<int> bp_bins;
+
+// Streaming parser of samtools mpileup text. Sites are passed to the
+// callback in input order, views point into the fed buffer or an internal
+// line buffer and no memory is allocated once buffers have grown.
+class parser {
+public:
+  typedef std::function<void(const site_view &)> site_callback;
+  // return false to skip a line without parsing the sample columns
+  typedef std::function<bool(std::string_view chr, int pos)> site_filter;
+
+  parser(const read_options &opt = read_options(),
+         site_callback callback = nullptr);
+
+  void set_filter(site_filter f) { filter = std::move(f); }
+
+  // feed text in chunks of any size, complete lines are parsed
+  void feed(const char *data, size_t size);
+  // parse the last line if it has no newline
+  void finish();
+  // parse one line (without newline), bypassing the filter and callback
+  const site_view &parse(std::string_view line);
+
+  // input bytes up to the end of the current line
+  uint64_t line_end() const { return end_offset; }
+  // text of the current line
+  std::string_view line() const { return cur_line; }
+
+private:
+  read_options opt;
+  site_callback callback;
+  site_filter filter;
+  std::string carry;
+  std::string_view cur_line;
+  uint64_t offset = 0, end_offset = 0;
+
+  site_view site;
+  std::vector<sample_counts> samples;
+  std::vector<motif_count> motifs, scratch[4];
+  std::vector<std::pair<size_t, size_t>> motif_ranges;
+  std::vector<int> hists;
+
+  void handle(std::string_view line, uint64_t end);
+  bool parse_sample(std::string_view bases, std::string_view mapqs,
+                    std::string_view bps, char ref, sample_counts &s);
+};
+
+// P-values of mutation counts, summed from tables of log factorials
+class scorer {
+public:
+  // one-sided binomial test of k or more mutations in n bases at rate p
+  double binom(int k, int n, double p);
+  // two-sided Fisher's exact test of table [[a, b], [c, d]]
+  double fisher(int a, int b, int c, int d);
+
+private:
+  std::vector<double> log_fact = {0};
+
+  double lfact(int n);
+  // log probability of x in hypergeometric with row sums r1, r2, col sum c1
+  double log_hyper(int x, int r1, int r2, int c1);
+};
+
+// Test of mut against coverage for each sample
+enum score_method { no_score, binom_score, fisher_score };
+
+// Options of filtering and output
+struct options {
+  bool hide_header = false;
+  bool to_upper = false;
+  bool reverse_strand = false;
+  bool stat_ends = false;
+  bool stat_indel = false;
+  bool hide_strand = false;
+  bool by_strand = false;
+  bool major_strand = false;
+  read_options read_opt;
+  std::vector<std::string> count_names = {};
+  std::map<std::string, int> any_cutoffs; // check any (max) value >= cutoff
+  std::map<std::string, int> all_cutoffs; // check all (min) value >= cutoff
+  score_method score = no_score;
+  std::vector<double> error_rates = {0.001}; // background rate of samples
+  int control = 0;                           // sample index of Fisher's test
+  double any_pval = -1; // check any p-value <= cutoff, when >= 0
+  double all_pval = -1; // check all p-values <= cutoff, when >= 0
+  std::vector<int> max_depths; // drop sites deeper in any sample, by sample
+  bool rle = false; // collapse runs of plain sites into one line
+};
+
+// Filters and output format of sites
+class formatter {
+public:
+  formatter(const options &opt);
+
+  void print_header(const site_view &site, std::ostream &out);
+  // filter a site and print it if passed, return if anything is printed
+  bool print_site(const site_view &site, std::ostream &out);
+  // print the pending run of plain sites, at the end of input
+  void finish(std::ostream &out);
+
+private:
+  options opt;
+  std::vector<int> columns; // field of count_names
+  std::vector<std::pair<int, int>> any_cutoffs, all_cutoffs;
+  std::vector<counter> fwd, rev;
+  std::vector<double> pvals, pvals_rev;
+  scorer scores;
+  std::string ref;
+  std::vector<std::pair<std::string, int>> merged;
+  // run of plain sites, with min and max depth of samples
+  std::string run_chr;
+  int run_start = 0, run_end = 0;
+  bool in_run = false;
+  std::vector<std::pair<int, int>> run_depths;
+
+  void print_counts(const counter &m, bool first, std::ostream &out);
+  void print_pval(double p, std::ostream &out);
+  // p-values of samples, return if they pass the cutoffs
+  bool score_samples(const std::vector<counter> &counts,
+                     const std::vector<counter> *rev_counts,
+                     std::vector<double> &out);
+  void print_motifs(span<motif_count> ids, std::ostream &out);
+  void print_merged(span<motif_count> upper, span<motif_count> lower,
+                    std::ostream &out);
+  void print_strand(const site_view &site, char strand, std::ostream &out);
+  void print_unstranded(const site_view &site, std::ostream &out);
+  void print_stranded(const site_view &site, std::ostream &out);
+  // with rle, add a plain site to the run and return true, or print the run
+  // before other sites
+  bool collapse(const site_view &site, std::ostream &out);
+};
+
+// Parser of lines printed by formatter with the same options, back into
+// sites. All count columns are needed (no count_names), not by strand. The
+// count of ref base is taken as ref, mismatches as mut.
+class record_parser {
+public:
+  record_parser(const options &opt);
+
+  // parse a line (without newline), the view points into the line
+  const site_view &parse(std::string_view line);
+  // records with a depth above the counted bases, as when bases equal to the
+  // ref letter were counted as mismatches, which the text does not keep
+  uint64_t inexact() const { return ninexact; }
+
+private:
+  options opt;
+  uint64_t ninexact = 0;
+  site_view site;
+  std::string ref;
+  std::vector<sample_counts> samples;
+  std::vector<motif_count> motifs;
+  std::vector<std::pair<size_t, size_t>> motif_ranges;
+  std::vector<int> hists;
+  std::vector<std::string_view> cols, values;
+
+  void parse_motifs(std::string_view text);
+  void parse_hist(std::string_view text, size_t size);
+};
+
+// Set of sites loaded from BED or VCF, queried in the order of sorted input
+class site_mask {
+public:
+  // no file loaded, a file without records still masks all sites
+  bool empty() const { return !loaded; }
+  void load(const std::string &path);
+  // check a site (1-based pos), the cursor moves forward with the input
+  bool contains(std::string_view chr, int pos);
+
+private:
+  // Sites of one contig, as sorted and merged intervals (0-based,
+  // half-open), or as a bitmap over [start, end) when intervals are dense
+  struct contig_mask {
+    std::vector<std::pair<int, int>> intervals;
+    std::vector<uint64_t> bits;
+    int start = 0, end = 0;
+    bool dense = false;
+  };
+
+  std::map<std::string, contig_mask, std::less<>> contigs;
+  bool loaded = false;
+  std::string cur_chr;
+  const contig_mask *cur = nullptr;
+  size_t cursor = 0;
+  int last_pos = -1;
+
+  static void build(contig_mask &c);
+};
+
+std::vector<std::string> split_string(const std::string &i_str,
+                                      const std::string &i_delim);
+// Get chr and pos of a mpileup line without parsing the sample columns
+bool split_site(std::string_view line, std::string &chr, int &pos);
+// Sort half-open intervals and merge the overlapping ones
+void merge_intervals(std::vector<std::pair<int, int>> &iv);
+// Field of counter with the count of a ref base, -1 if it has none
+int ref_field(char ref);
+// Point the spans of a site and its samples into the pools, once they are
+// complete. Ranges are ins_fwd, ins_rev, del_fwd, del_rev of each sample, and
+// each sample has nhist bins, the first nmapq of which are MAPQ.
+void point_spans(site_view &site, std::vector<sample_counts> &samples,
+                 size_t nsample, std::vector<motif_count> &motifs,
+                 const std::vector<std::pair<size_t, size_t>> &ranges,
+                 std::vector<int> &hists, size_t nmapq, size_t nhist);
+
+} // namespace cpup
+
+#endif // LIBCPUP_HPP
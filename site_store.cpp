@@ -0,0 +1,351 @@
+/*
+ * site_store.cpp
+ * Copyright (C) 2021 Ye Chang <yech1990@gmail.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "site_store.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+namespace cpup {
+
+static const char store_magic[4] = {'C', 'P', 'S', 1};
+// fields of counter in the store, coverage is ref + mut
+static const int nstored = counter::nfield - 1;
+// mask has bits of fwd and rev for each field, so that the common ones (ref,
+// mut) fit in the first byte of varint
+static const uint64_t motif_bit = 1ull << (2 * nstored);
+static const uint64_t ends_bit = motif_bit << 1;
+
+static inline uint64_t zigzag(int64_t v) { return (v << 1) ^ (v >> 63); }
+static inline int64_t unzigzag(uint64_t v) { return (v >> 1) ^ -(v & 1); }
+
+store_writer::store_writer(FILE *fp, const read_options &opt)
+    : fp(fp), opt(opt) {}
+
+void store_writer::put(uint64_t v) {
+  while (v >= 0x80) {
+    buf.push_back((char)(v | 0x80));
+    v >>= 7;
+  }
+  buf.push_back((char)v);
+}
+
+void store_writer::put_name(map<string, uint32_t, less<>> &ids,
+                            string_view name) {
+  auto it = ids.find(name);
+  if (it != ids.end()) {
+    put(it->second);
+    return;
+  }
+  uint32_t id = ids.size();
+  ids.emplace(string(name), id);
+  put(id);
+  put(name.size());
+  buf.append(name);
+}
+
+void store_writer::start(size_t nsample) {
+  buf.append(store_magic, sizeof(store_magic));
+  put(nsample);
+  buf.push_back((char)((opt.mapq_hist ? 1 : 0) | (opt.bp_hist ? 2 : 0)));
+  started = true;
+}
+
+void store_writer::put_counts(const sample_counts &s, int skip) {
+  put(s.depth);
+  uint64_t mask = 0;
+  for (int f = 1; f < counter::nfield; f++) {
+    if (f != skip) {
+      mask |= (uint64_t)(s.fwd[f] != 0) << (2 * (f - 1));
+      mask |= (uint64_t)(s.rev[f] != 0) << (2 * (f - 1) + 1);
+    }
+  }
+  bool has_motifs = !s.ins_fwd.empty() || !s.ins_rev.empty() ||
+                    !s.del_fwd.empty() || !s.del_rev.empty();
+  mask |= has_motifs ? motif_bit : 0;
+  mask |= (s.sstat != 0 || s.estat != 0) ? ends_bit : 0;
+  put(mask);
+  for (int f = 1; f < counter::nfield; f++) {
+    if (mask & (1ull << (2 * (f - 1)))) {
+      put(s.fwd[f]);
+    }
+    if (mask & (1ull << (2 * (f - 1) + 1))) {
+      put(s.rev[f]);
+    }
+  }
+  if (has_motifs) {
+    for (auto ids : {s.ins_fwd, s.ins_rev, s.del_fwd, s.del_rev}) {
+      put(ids.size());
+      for (auto &m : ids) {
+        put_name(motif_ids, m.motif);
+        put(m.count);
+      }
+    }
+  }
+  if (mask & ends_bit) {
+    put(s.sstat);
+    put(s.estat);
+  }
+  for (auto hist : {s.mapq_hist, s.bp_hist}) {
+    for (int v : hist) {
+      put(v);
+    }
+  }
+}
+
+void store_writer::add(const site_view &site) {
+  if (!started) {
+    start(site.samples.size());
+  }
+  bool new_chr = site.chr != last_chr;
+  if (new_chr) {
+    last_chr.assign(site.chr);
+    last_pos = 0;
+  }
+  put(zigzag((int64_t)site.pos - last_pos) << 1 | (new_chr ? 1 : 0));
+  if (new_chr) {
+    put_name(chr_ids, site.chr);
+  }
+  last_pos = site.pos;
+  // single base in one byte
+  if (site.ref.size() == 1 && site.ref[0] != '\0') {
+    buf.push_back(site.ref[0]);
+  } else {
+    buf.push_back('\0');
+    put(site.ref.size());
+    buf.append(site.ref);
+  }
+  put(site.samples.size());
+  int skip = ref_field(site.ref.empty() ? '\0' : site.ref[0]);
+  for (auto &s : site.samples) {
+    put_counts(s, skip);
+  }
+  if (buf.size() >= (1 << 20)) {
+    flush();
+  }
+}
+
+void store_writer::flush() {
+  if (!buf.empty() && fwrite(buf.data(), 1, buf.size(), fp) != buf.size()) {
+    throw runtime_error("Can not write site store");
+  }
+  written += buf.size();
+  buf.clear();
+  if (fflush(fp) != 0) {
+    throw runtime_error("Can not write site store");
+  }
+}
+
+store_reader::store_reader(FILE *fp) : fp(fp), buf(1 << 20) {
+  char magic[sizeof(store_magic)];
+  if (!fill(sizeof(magic))) {
+    return; // no site
+  }
+  memcpy(magic, buf.data(), sizeof(magic));
+  at += sizeof(magic);
+  if (memcmp(magic, store_magic, sizeof(magic)) != 0) {
+    throw runtime_error("Invalid site store");
+  }
+  nfirst = get();
+  int flags = get_byte();
+  mapq_hist = flags & 1;
+  bp_hist = flags & 2;
+}
+
+// make at least need bytes available, false at the end of file
+bool store_reader::fill(size_t need) {
+  if (size - at >= need) {
+    return true;
+  }
+  memmove(buf.data(), buf.data() + at, size - at);
+  size -= at;
+  at = 0;
+  if (buf.size() < need) {
+    buf.resize(need);
+  }
+  while (size < need) {
+    size_t n = fread(buf.data() + size, 1, buf.size() - size, fp);
+    if (n == 0) {
+      return false;
+    }
+    size += n;
+  }
+  return true;
+}
+
+int store_reader::get_byte() {
+  if (!fill(1)) {
+    throw runtime_error("Truncated site store");
+  }
+  return (unsigned char)buf[at++];
+}
+
+uint64_t store_reader::get() {
+  uint64_t v = 0;
+  for (int shift = 0;; shift += 7) {
+    int b = at < size ? (unsigned char)buf[at++] : get_byte();
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (b < 0x80) {
+      return v;
+    }
+  }
+}
+
+string_view store_reader::get_name(deque<string> &names) {
+  size_t id = get();
+  if (id == names.size()) {
+    size_t len = get();
+    if (!fill(len)) {
+      throw runtime_error("Truncated site store");
+    }
+    names.emplace_back(buf.data() + at, len);
+    at += len;
+  } else if (id > names.size()) {
+    throw runtime_error("Invalid site store");
+  }
+  return names[id];
+}
+
+bool store_reader::next(const site_view *&out) {
+  if (!fill(1)) {
+    return false;
+  }
+  uint64_t head = get();
+  if (head & 1) {
+    site.chr = get_name(chrs);
+    site.pos = 0;
+  }
+  site.pos += unzigzag(head >> 1);
+  char c = get_byte();
+  if (c != '\0') {
+    ref.assign(1, c);
+  } else {
+    size_t len = get();
+    if (!fill(len)) {
+      throw runtime_error("Truncated site store");
+    }
+    ref.assign(buf.data() + at, len);
+    at += len;
+  }
+  site.ref = ref;
+
+  size_t nsample = get();
+  int skip = ref_field(ref.empty() ? '\0' : ref[0]);
+  size_t nhist = (mapq_hist ? mapq_bins.size() : 0) +
+                 (bp_hist ? bp_bins.size() : 0);
+  samples.assign(nsample, sample_counts());
+  counts.clear();
+  hists.assign(nsample * nhist, 0);
+  ranges.clear();
+  for (size_t i = 0; i < nsample; i++) {
+    sample_counts &s = samples[i];
+    s.depth = get();
+    uint64_t mask = get();
+    for (int f = 1; f < counter::nfield; f++, mask >>= 2) {
+      s.fwd[f] = (mask & 1) ? get() : 0;
+      s.rev[f] = (mask & 2) ? get() : 0;
+    }
+    for (counter *m : {&s.fwd, &s.rev}) {
+      (*m)[counter::coverage] = (*m)[counter::ref] + (*m)[counter::mut];
+      if (skip >= 0) {
+        (*m)[skip] = (*m)[counter::ref];
+      }
+    }
+    // motif and ends bits are next in the mask
+    if (mask & 1) {
+      for (int k = 0; k < 4; k++) {
+        size_t n = get();
+        size_t first = counts.size();
+        for (size_t j = 0; j < n; j++) {
+          string_view motif = get_name(motifs);
+          counts.push_back(motif_count{motif, (int)get()});
+        }
+        ranges.emplace_back(first, counts.size());
+      }
+    } else {
+      for (int k = 0; k < 4; k++) {
+        ranges.emplace_back(counts.size(), counts.size());
+      }
+    }
+    if (mask & 2) {
+      s.sstat = get();
+      s.estat = get();
+    }
+    for (size_t k = 0; k < nhist; k++) {
+      hists[i * nhist + k] = get();
+    }
+  }
+  // spans point into the pools once they are complete
+  point_spans(site, samples, nsample, counts, ranges, hists,
+              mapq_hist ? mapq_bins.size() : 0, nhist);
+  // only ref bases, as the parser tells from the bases
+  site.plain = true;
+  for (auto &s : samples) {
+    for (const counter *m : {&s.fwd, &s.rev}) {
+      for (int f : {counter::mut, counter::skip, counter::gap, counter::insert,
+                    counter::del}) {
+        site.plain = site.plain && (*m)[f] == 0;
+      }
+      site.plain = site.plain && (skip == counter::n || (*m)[counter::n] == 0);
+    }
+  }
+  out = &site;
+  return true;
+}
+
+void site_stats::add(const site_view &site) {
+  size_t nsample = site.samples.size();
+  if (depths.size() < nsample) {
+    mut.resize(nsample);
+    coverage.resize(nsample);
+    depths.resize(nsample);
+  }
+  for (size_t i = 0; i < nsample; i++) {
+    const sample_counts &s = site.samples[i];
+    mut[i] += s.fwd[counter::mut] + s.rev[counter::mut];
+    coverage[i] += s.fwd[counter::coverage] + s.rev[counter::coverage];
+    size_t depth = max(s.depth, 0);
+    if (depths[i].size() <= depth) {
+      depths[i].resize(depth + 1);
+    }
+    depths[i][depth]++;
+  }
+  nsite++;
+}
+
+double site_stats::background_rate(size_t i) const {
+  uint64_t n = i < coverage.size() ? coverage[i] : 0;
+  double rate = n > 0 ? (double)mut[i] / n : 0;
+  // without any mismatch, a rate of 0 would make every mismatch significant
+  return max(rate, 1.0 / (n + 1));
+}
+
+int site_stats::depth_percentile(size_t i, double pct) const {
+  if (i >= depths.size()) {
+    return 0;
+  }
+  // smallest depth with at least pct of sites at or below it
+  uint64_t total = 0;
+  for (uint64_t n : depths[i]) {
+    total += n;
+  }
+  uint64_t need = (uint64_t)ceil(total * pct / 100);
+  uint64_t sum = 0;
+  for (size_t d = 0; d < depths[i].size(); d++) {
+    sum += depths[i][d];
+    if (sum >= need && sum > 0) {
+      return d;
+    }
+  }
+  return depths[i].size() - 1;
+}
+
+} // namespace cpup
@@ -0,0 +1,117 @@
+/*
+ * site_store.hpp
+ * Copyright (C) 2021 Ye Chang <yech1990@gmail.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef SITE_STORE_HPP
+#define SITE_STORE_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "libcpup.hpp"
+
+namespace cpup {
+
+// Compact binary store of parsed sites, in the order of input. Positions are
+// delta encoded, counters are varints of the non-zero fields only, and contig
+// names and indel sequences are interned on first use.
+//
+//   header: "CPS\1", varint nsample, byte flags (1: mapq_hist, 2: bp_hist)
+//   site:   varint pos delta << 1 | new contig, [contig], ref, nsample,
+//           samples
+//   sample: varint depth, varint mask of non-zero fields, fields (but the
+//           count of ref base, which is ref),
+//           [indels of 4 lists], [sstat estat], [histograms]
+//
+// An interned name is a varint id, followed by its length and bytes when it
+// is the next new id.
+class store_writer {
+public:
+  // write to fp, which must be open for writing
+  store_writer(FILE *fp, const read_options &opt);
+  ~store_writer() { flush(); }
+
+  void add(const site_view &site);
+  // write the buffered sites, throw on error
+  void flush();
+  // bytes written so far
+  uint64_t bytes() const { return written + buf.size(); }
+
+private:
+  FILE *fp;
+  read_options opt;
+  std::string buf;
+  uint64_t written = 0;
+  bool started = false;
+  std::map<std::string, uint32_t, std::less<>> chr_ids, motif_ids;
+  std::string last_chr;
+  int last_pos = 0;
+
+  void start(size_t nsample);
+  void put(uint64_t v);
+  void put_name(std::map<std::string, uint32_t, std::less<>> &ids,
+                std::string_view name);
+  // counts of a sample, without the field of ref base
+  void put_counts(const sample_counts &s, int skip);
+};
+
+// Read sites back from a store, as views valid until the next site
+class store_reader {
+public:
+  // read from fp, from its current position
+  store_reader(FILE *fp);
+
+  bool next(const site_view *&site);
+  // samples of the first site, 0 for an empty store
+  size_t first_samples() const { return nfirst; }
+
+private:
+  FILE *fp;
+  size_t nfirst = 0;
+  std::vector<char> buf;
+  size_t at = 0, size = 0;
+  bool mapq_hist = false, bp_hist = false;
+  // interned names, a deque keeps views into them valid
+  std::deque<std::string> chrs, motifs;
+
+  site_view site;
+  std::string ref;
+  std::vector<sample_counts> samples;
+  std::vector<motif_count> counts;
+  std::vector<std::pair<size_t, size_t>> ranges;
+  std::vector<int> hists;
+
+  bool fill(size_t need);
+  int get_byte();
+  uint64_t get();
+  std::string_view get_name(std::deque<std::string> &names);
+};
+
+// Genome-wide statistics of samples, collected on the first pass
+class site_stats {
+public:
+  void add(const site_view &site);
+
+  size_t samples() const { return depths.size(); }
+  // mismatches over coverage of a sample, at least 1 / (coverage + 1)
+  double background_rate(size_t i) const;
+  // depth of a sample at the percentile (0-100) of sites
+  int depth_percentile(size_t i, double pct) const;
+
+private:
+  std::vector<uint64_t> mut, coverage;
+  std::vector<std::vector<uint64_t>> depths; // sites by depth
+  uint64_t nsite = 0;
+};
+
+} // namespace cpup
+
+#endif // SITE_STORE_HPP